@@ -3,27 +3,61 @@
 #include <cstring>
 #include <type_traits>
 #include <algorithm>
+#include <chrono>
+#include <numeric>
 #include <limits>
 #include <optional>
 #include <random>
 #include <array>
 #include <string>
+#include <string_view>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <utility>
+#include <iterator>
+#include <thread>
 #include "error.h"
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__)
+    #include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+    #include <arm_acle.h>
+#endif
+
 #if defined(__unix__)
     #include <fcntl.h>
     #include <unistd.h>
     #include <sys/mman.h>
+    #include <sys/stat.h>
 #else
     #error "Unsupported operating system"
 #endif
 
+#if defined(__linux__)
+    #include <cerrno>
+    #include <sys/syscall.h>
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+    #endif
+#endif
+
 
 namespace impl {
 
 template<typename> constexpr bool always_false_v = false;
 const std::string HASH_SUFFIX = ".hash";
 const std::string VALUE_SUFFIX = ".value";
+const std::string KEY_SUFFIX = ".key";
+const std::string WAL_SUFFIX = ".wal";
+const std::string BLOOM_SUFFIX = ".bloom";
+const std::string TMP_SUFFIX = ".tmp";
+const std::string CHECKPOINT_SUFFIX = ".ckpt";
 
 #if defined(_WIN32)
     constexpr std::string_view PATH_SEPARATOR = "\\";
@@ -91,12 +125,41 @@ inline void read(file_h h, void* data, size_t nbytes) {
 #endif
 }
 
+inline size_t pwrite(file_h h, const void* data, size_t nbytes, size_t offset) {
+#if defined(__unix__)
+    ssize_t s = ::pwrite(h, data, nbytes, offset);
+    assume(s != -1);
+    assume(static_cast<size_t>(s) == nbytes);
+    return static_cast<size_t>(s);
+#endif
+}
+
+inline void pread(file_h h, void* data, size_t nbytes, size_t offset) {
+#if defined(__unix__)
+    assume(static_cast<size_t>(::pread(h, data, nbytes, offset)) == nbytes);
+#endif
+}
+
+inline void sync(file_h h) {
+#if defined(__linux__)
+    ::fdatasync(h);
+#elif defined(__unix__)
+    ::fsync(h);
+#endif
+}
+
+inline void msync(void* m, size_t size) {
+#if defined(__unix__)
+    ::msync(m, size, MS_SYNC);
+#endif
+}
+
 inline file_o size(file_h h) {
-    file_o o = impl::tell(h);
-    impl::seek_end(h);
-    file_o s = impl::tell(h);
-    impl::seek(h, o);
-    return s;
+#if defined(__unix__)
+    struct stat st;
+    assume(::fstat(h, &st) != -1);
+    return st.st_size;
+#endif
 }
 
 inline void resize(file_h h, size_t s) {
@@ -105,12 +168,135 @@ inline void resize(file_h h, size_t s) {
 #endif
 }
 
+// Syncs the directory holding 'filepath': creating or renaming a file is only durable once its directory entry is
+inline void sync_directory(const std::string& filepath) {
+#if defined(__unix__)
+    size_t sep = filepath.rfind(PATH_SEPARATOR);
+    std::string dir = sep == std::string::npos ? std::string{"."} : filepath.substr(0, sep + 1);
+    file_h h = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    assume(h != -1);
+    assume(::fsync(h) == 0);
+    ::close(h);
+#endif
+}
+
+inline void rename(const std::string& from, const std::string& to) {
+    if(std::rename(from.c_str(), to.c_str()) != 0) except("Cannot rename '{}' to '{}'", from, to);
+    impl::sync_directory(to);
+}
+
+// Gives the blocks of a range back to the filesystem, the range reads as zeros afterwards
+inline void punch_hole([[maybe_unused]] file_h h, [[maybe_unused]] size_t offset, [[maybe_unused]] size_t nbytes) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    ::fallocate(h, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<file_o>(offset), static_cast<file_o>(nbytes));
+#endif
+}
+
+// 'populate' faults every page in before returning
 template<typename T>
-inline T* mmap(file_h h, size_t size) {
+inline T* mmap(file_h h, size_t size, bool priv = false, [[maybe_unused]] bool populate = false) {
+#if defined(__unix__)
+    int flags = priv ? MAP_PRIVATE : MAP_SHARED;
+#if defined(MAP_POPULATE)
+    if(populate) flags |= MAP_POPULATE;
+#endif
+    void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, h, 0);
+    return p != MAP_FAILED ? reinterpret_cast<T*>(p) : nullptr;
+#endif
+
+}
+
+// Starts reading a mapped range ahead of its first use
+inline void will_need([[maybe_unused]] void* m, [[maybe_unused]] size_t size) {
+#if defined(__unix__)
+    ::madvise(m, size, MADV_WILLNEED);
+#endif
+}
+
+enum class advice {
+    normal,
+    random,     // No readahead around faults
+    sequential, // Aggressive readahead, pages behind are dropped early
+};
+
+inline void advise([[maybe_unused]] void* m, [[maybe_unused]] size_t size, [[maybe_unused]] advice a) {
+#if defined(__unix__)
+    switch(a) {
+        case advice::random: ::madvise(m, size, MADV_RANDOM); break;
+        case advice::sequential: ::madvise(m, size, MADV_SEQUENTIAL); break;
+        default: ::madvise(m, size, MADV_NORMAL); break;
+    }
+#endif
+}
+
+// Asks for transparent huge pages, only honored where the filesystem can cache files in them
+inline void huge_pages([[maybe_unused]] void* m, [[maybe_unused]] size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    ::madvise(m, size, MADV_HUGEPAGE);
+#endif
+}
+
+// Faults in a mapped range for reading, one page at a time where MADV_POPULATE_READ (Linux 5.14) is missing
+inline void prefault(const void* m, size_t size) {
+#if defined(__linux__) && defined(MADV_POPULATE_READ)
+    if(::madvise(const_cast<void*>(m), size, MADV_POPULATE_READ) == 0) return;
+#endif
+
+    const volatile char* p = static_cast<const volatile char*>(m);
+    for(size_t o = 0; o < size; o += 4096) static_cast<void>(p[o]);
+}
+
+inline size_t page_size() {
+#if defined(__unix__)
+    static const size_t size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return size;
+#endif
+}
+
+// Offsets of the pages of a private file mapping written (copied on write) since it was mapped, from /proc/self/pagemap.
+// False where pagemap cannot be read.
+inline bool dirty_pages([[maybe_unused]] const void* m, [[maybe_unused]] size_t size, [[maybe_unused]] std::vector<size_t>& offsets) {
+#if defined(__linux__)
+    constexpr uint64_t PRESENT = uint64_t{1} << 63, SWAPPED = uint64_t{1} << 62, FILE_PAGE = uint64_t{1} << 61;
+    const size_t page = impl::page_size(), first = reinterpret_cast<uintptr_t>(m) / page, count = (size + page - 1) / page;
+
+    file_h h = ::open("/proc/self/pagemap", O_RDONLY);
+    if(h == -1) return false;
+
+    std::vector<uint64_t> entries(std::min<size_t>(count, 64 * 1024));
+    bool ok = true;
+
+    for(size_t i = 0; ok && i < count; i += entries.size()) {
+        size_t n = std::min(entries.size(), count - i), nbytes = n * sizeof(uint64_t);
+        ok = ::pread(h, entries.data(), nbytes, static_cast<file_o>((first + i) * sizeof(uint64_t))) == static_cast<ssize_t>(nbytes);
+
+        for(size_t j = 0; ok && j < n; ++j) {
+            uint64_t e = entries[j];
+            if((e & SWAPPED) || ((e & PRESENT) && !(e & FILE_PAGE))) offsets.push_back((i + j) * page);
+        }
+    }
+
+    ::close(h);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+// Drops the private copies of a range of a private file mapping, it reads the file again afterwards
+inline void discard([[maybe_unused]] void* m, [[maybe_unused]] size_t size) {
 #if defined(__unix__)
-    return reinterpret_cast<T*>(::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, h, 0));
+    ::madvise(m, size, MADV_DONTNEED);
 #endif
+}
 
+// Zero filled memory that only takes room once written
+template<typename T>
+inline T* mmap_anonymous(size_t size) {
+#if defined(__unix__)
+    void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p != MAP_FAILED ? reinterpret_cast<T*>(p) : nullptr;
+#endif
 }
 
 inline void munmap(void* m, [[maybe_unused]] size_t size) {
@@ -119,6 +305,230 @@ inline void munmap(void* m, [[maybe_unused]] size_t size) {
 #endif
 }
 
+template<typename T>
+inline T* mremap(T* m, size_t oldsize, size_t newsize, file_h h, bool priv = false) {
+#if defined(__linux__)
+    [[maybe_unused]] file_h unused = h;
+    [[maybe_unused]] bool unusedpriv = priv;
+    void* p = ::mremap(m, oldsize, newsize, MREMAP_MAYMOVE);
+    return p != MAP_FAILED ? reinterpret_cast<T*>(p) : nullptr;
+#elif defined(__unix__)
+    // A private mapping would lose its changes, copy them over
+    T* n = impl::mmap<T>(h, newsize, priv);
+    if(n && priv) std::copy_n(reinterpret_cast<const char*>(m), oldsize, reinterpret_cast<char*>(n));
+    impl::munmap(m, oldsize);
+    return n;
+#endif
+}
+
+// Single writer, many readers: the writer publishes with release semantics,
+// readers observe with acquire semantics (see hashdb_flags_concurrent)
+template<typename T>
+inline T atomic_load(const T& t) { return __atomic_load_n(&t, __ATOMIC_ACQUIRE); }
+
+template<typename T>
+inline T atomic_load_relaxed(const T& t) { return __atomic_load_n(&t, __ATOMIC_RELAXED); }
+
+template<typename T>
+inline void atomic_store(T& t, T v) { __atomic_store_n(&t, v, __ATOMIC_RELEASE); }
+
+template<typename T>
+inline void atomic_store_relaxed(T& t, T v) { __atomic_store_n(&t, v, __ATOMIC_RELAXED); }
+
+template<typename T>
+inline T atomic_add(T& t, T v) { return __atomic_add_fetch(&t, v, __ATOMIC_SEQ_CST); }
+
+template<typename T>
+inline void atomic_add_relaxed(T& t, T v) { __atomic_fetch_add(&t, v, __ATOMIC_RELAXED); }
+
+template<typename T>
+inline void atomic_or_relaxed(T& t, T v) { __atomic_fetch_or(&t, v, __ATOMIC_RELAXED); }
+
+template<typename T>
+inline void atomic_and_relaxed(T& t, T v) { __atomic_fetch_and(&t, v, __ATOMIC_RELAXED); }
+
+inline void atomic_fence_acquire() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+inline void atomic_fence_release() { __atomic_thread_fence(__ATOMIC_RELEASE); }
+inline void atomic_fence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_OFF_SQ_RING)
+// File reads through io_uring, set up with raw syscalls: reads are queued in the shared submission ring
+// and handed to the kernel in batches, so many of them are in flight at once.
+// setup() fails where io_uring is missing or denied (old kernels, seccomp), callers then fall back to pread().
+class io_ring {
+public:
+    io_ring() = default;
+    io_ring(const io_ring&) = delete;
+    io_ring& operator=(const io_ring&) = delete;
+    ~io_ring() { this->close(); }
+
+    bool valid() const { return m_fd != INVALID_HANDLE; }
+    unsigned capacity() const { return m_entries; }
+
+    bool setup(unsigned entries) {
+        this->close();
+
+        io_uring_params p{};
+        int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+        if(fd < 0) return false;
+        m_fd = fd;
+
+        m_sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cqsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        m_sqesize = p.sq_entries * sizeof(io_uring_sqe);
+        if(p.features & IORING_FEAT_SINGLE_MMAP) m_sqsize = m_cqsize = std::max(m_sqsize, m_cqsize);
+
+        m_sq = this->map(m_sqsize, IORING_OFF_SQ_RING);
+        m_cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? m_sq : this->map(m_cqsize, IORING_OFF_CQ_RING);
+        m_sqes = reinterpret_cast<io_uring_sqe*>(this->map(m_sqesize, IORING_OFF_SQES));
+
+        if(!m_sq || !m_cq || !m_sqes) {
+            this->close();
+            return false;
+        }
+
+        m_sqhead = reinterpret_cast<unsigned*>(m_sq + p.sq_off.head);
+        m_sqtail = reinterpret_cast<unsigned*>(m_sq + p.sq_off.tail);
+        m_sqmask = *reinterpret_cast<unsigned*>(m_sq + p.sq_off.ring_mask);
+        m_cqhead = reinterpret_cast<unsigned*>(m_cq + p.cq_off.head);
+        m_cqtail = reinterpret_cast<unsigned*>(m_cq + p.cq_off.tail);
+        m_cqmask = *reinterpret_cast<unsigned*>(m_cq + p.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(m_cq + p.cq_off.cqes);
+        m_entries = p.sq_entries;
+
+        // Submission i always uses entry i
+        unsigned* array = reinterpret_cast<unsigned*>(m_sq + p.sq_off.array);
+        for(unsigned i = 0; i < m_entries; ++i) array[i] = i;
+        return true;
+    }
+
+    void close() {
+        if(m_sqes) impl::munmap(m_sqes, m_sqesize);
+        if(m_cq && m_cq != m_sq) impl::munmap(m_cq, m_cqsize);
+        if(m_sq) impl::munmap(m_sq, m_sqsize);
+        if(m_fd != INVALID_HANDLE) impl::close(m_fd);
+
+        m_sq = m_cq = nullptr;
+        m_sqes = nullptr;
+        m_fd = INVALID_HANDLE;
+        m_entries = m_queued = 0;
+    }
+
+    // Queues a read of 'nbytes' at 'offset', false when the submission ring is full
+    bool read(file_h h, void* data, size_t nbytes, size_t offset, uint64_t tag) {
+        unsigned tail = *m_sqtail;
+        if(tail - impl::atomic_load(*m_sqhead) >= m_entries) return false;
+
+        io_uring_sqe* sqe = m_sqes + (tail & m_sqmask);
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = h;
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<uintptr_t>(data);
+        sqe->len = static_cast<uint32_t>(nbytes);
+        sqe->user_data = tag;
+
+        impl::atomic_store(*m_sqtail, tail + 1);
+        ++m_queued;
+        return true;
+    }
+
+    // Hands the queued reads to the kernel with a single syscall, then waits for at least 'wait' completions
+    void submit(unsigned wait = 0) {
+        if(!m_queued && !wait) return;
+
+        for(;;) {
+            long r = ::syscall(__NR_io_uring_enter, m_fd, m_queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if(r < 0 && errno == EINTR) continue;
+            assume(r >= 0);
+            m_queued -= static_cast<unsigned>(r);
+            if(!m_queued) return;
+        }
+    }
+
+    // Calls f(tag, result) for up to 'max' completions, 'result' is the number of bytes read or -errno
+    template<typename Function>
+    unsigned reap(unsigned max, Function f) {
+        unsigned head = *m_cqhead, n = 0;
+        const unsigned tail = impl::atomic_load(*m_cqtail);
+
+        for( ; head != tail && n < max; ++head, ++n) {
+            const io_uring_cqe& cqe = m_cqes[head & m_cqmask];
+            f(cqe.user_data, cqe.res);
+        }
+
+        impl::atomic_store(*m_cqhead, head);
+        return n;
+    }
+
+private:
+    char* map(size_t size, off_t offset) const {
+        void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        return p != MAP_FAILED ? static_cast<char*>(p) : nullptr;
+    }
+
+    file_h m_fd{INVALID_HANDLE};
+    char* m_sq{nullptr};
+    char* m_cq{nullptr};
+    io_uring_sqe* m_sqes{nullptr};
+    io_uring_cqe* m_cqes{nullptr};
+    unsigned* m_sqhead{nullptr};
+    unsigned* m_sqtail{nullptr};
+    unsigned* m_cqhead{nullptr};
+    unsigned* m_cqtail{nullptr};
+    unsigned m_sqmask{0}, m_cqmask{0};
+    unsigned m_entries{0}, m_queued{0};
+    size_t m_sqsize{0}, m_cqsize{0}, m_sqesize{0};
+};
+#else
+// No io_uring: setup() always fails and reads go through pread()
+class io_ring {
+public:
+    bool valid() const { return false; }
+    unsigned capacity() const { return 0; }
+    bool setup(unsigned) { return false; }
+    void close() { }
+    bool read(file_h, void*, size_t, size_t, uint64_t) { return false; }
+    void submit(unsigned = 0) { }
+    template<typename Function> unsigned reap(unsigned, Function) { return 0; }
+};
+#endif
+
+// SwissTable-style control bytes, matched 16 at a time
+constexpr size_t GROUP_SIZE = 16;
+
+inline uint32_t group_match(const unsigned char* ctrl, unsigned char c) {
+#if defined(__SSE2__)
+    __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(static_cast<char>(c)))));
+#else
+    uint32_t m = 0;
+    for(size_t i = 0; i < GROUP_SIZE; ++i) m |= static_cast<uint32_t>(ctrl[i] == c) << i;
+    return m;
+#endif
+}
+
+inline size_t lowest_bit(uint32_t m) { return static_cast<size_t>(__builtin_ctz(m)); }
+inline void prefetch(const void* p) { __builtin_prefetch(p, 0, 3); }
+
+// Runs f(t) for t in [0, threads), the calling thread takes t = 0
+template<typename Function>
+void parallel(size_t threads, Function f) {
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for(size_t t = 1; t < threads; ++t) workers.emplace_back(f, t);
+    f(size_t{0});
+    for(std::thread& w : workers) w.join();
+}
+
 inline size_t fnv1a(const void* data, size_t size) {
     constexpr size_t FNV_OFFSET_BASIS = [](){
         if constexpr(sizeof(size_t) == sizeof(uint64_t)) return 14695981039346656037ULL;
@@ -166,441 +576,4189 @@ inline size_t fnv1a(double value) {
     return impl::fnv1a(&bits, sizeof(bits));
 }
 
-struct Serializer {
-    template<typename T, typename Reader>
-    static void deserialize(T& t, Reader r) {
-        using U = std::decay_t<T>;
+// 64x64 -> 128 bit multiply, 'a' receives the low half and 'b' the high one
+inline void mum(uint64_t& a, uint64_t& b) {
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = static_cast<unsigned __int128>(a) * b;
+    a = static_cast<uint64_t>(r);
+    b = static_cast<uint64_t>(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = static_cast<uint32_t>(a), lb = static_cast<uint32_t>(b);
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+    uint64_t lo = t + (rm1 << 32);
+    b = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+    a = lo;
+#endif
+}
 
-        if constexpr(std::is_integral_v<U> || std::is_floating_point_v<U>)
-            r(reinterpret_cast<void*>(&t), sizeof(T));
-        else if constexpr(std::is_same_v<U, std::string>) {
-            std::string::size_type size;
-            r(reinterpret_cast<void*>(&size), sizeof(std::string::size_type));
+// The mixing step of wyhash: both halves of the product folded together
+inline uint64_t wymix(uint64_t a, uint64_t b) {
+    impl::mum(a, b);
+    return a ^ b;
+}
 
-            t.resize(size);
-            r(reinterpret_cast<void*>(t.data()), size);
-        }
-        else
-            t.deserialize(r);
-    }
+inline uint64_t read64(const unsigned char* p) { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+inline uint64_t read32(const unsigned char* p) { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
 
-    template<typename T, typename Writer>
-    static void serialize(T&& t, Writer w) {
-        using U = std::decay_t<T>;
+constexpr uint64_t WYP[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
 
-        if constexpr(std::is_integral_v<U> || std::is_floating_point_v<U>)
-            w(reinterpret_cast<void*>(&t), sizeof(T));
-        else if constexpr(std::is_same_v<U, std::string>) {
-            std::string::size_type size = t.size();
-            w(reinterpret_cast<void*>(&size), sizeof(std::string::size_type));
-            w(t.c_str(), t.size());
+// wyhash: 16 (48 on long inputs) bytes per step, three independent multiply chains
+inline uint64_t wyhash(const void* data, size_t size, uint64_t seed = 0) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t a, b;
+    seed ^= impl::wymix(seed ^ WYP[0], WYP[1]);
+
+    if(size <= 16) {
+        if(size >= 4) {
+            a = (impl::read32(p) << 32) | impl::read32(p + ((size >> 3) << 2));
+            b = (impl::read32(p + size - 4) << 32) | impl::read32(p + size - 4 - ((size >> 3) << 2));
+        }
+        else if(size) {
+            a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[size >> 1]) << 8) | p[size - 1];
+            b = 0;
         }
         else
-            t.serialize(w);
+            a = b = 0;
     }
-};
-
-} // namespace impl
+    else {
+        size_t i = size;
 
-enum hashdb_flags {
-    hashdb_flags_none   = 0,
-    hashdb_flags_split  = (1 << 0),
-    hashdb_flags_remove = (1 << 1),
-};
+        if(i > 48) {
+            uint64_t see1 = seed, see2 = seed;
 
-template<typename K, typename V, size_t Flags = hashdb_flags_none, typename Serializer = impl::Serializer>
-class HashDB
-{
-    using Self = HashDB<K, V, Flags, Serializer>;
+            do {
+                seed = impl::wymix(impl::read64(p) ^ WYP[1], impl::read64(p + 8) ^ seed);
+                see1 = impl::wymix(impl::read64(p + 16) ^ WYP[2], impl::read64(p + 24) ^ see1);
+                see2 = impl::wymix(impl::read64(p + 32) ^ WYP[3], impl::read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
 
-    static constexpr bool SPLIT_VALUE = (Flags & hashdb_flags_split) || (sizeof(V) > sizeof(uintptr_t));
-    static constexpr size_t SIGNATURE = 0x5d1b0239;
-    static constexpr size_t DEFAULT_ITEMS_COUNT = 4096;
-    static constexpr float MAX_FILL_CAPACITY = 0.75;
+            seed ^= see1 ^ see2;
+        }
 
-    enum {
-        STATE_EMPTY = 0,
-        STATE_TOMBSTONE,
-        STATE_FULL,
-    };
+        for( ; i > 16; i -= 16, p += 16)
+            seed = impl::wymix(impl::read64(p) ^ WYP[1], impl::read64(p + 8) ^ seed);
 
-    struct hash_offset_value {
-        size_t capacity;
-        size_t offset;
-    };
+        a = impl::read64(p + i - 16);
+        b = impl::read64(p + i - 8);
+    }
 
-    struct kv_pair {
-        size_t state;
-        K key;
-        std::conditional_t<SPLIT_VALUE, hash_offset_value, V> value;
-    };
+    a ^= WYP[1];
+    b ^= seed;
+    impl::mum(a, b);
+    return impl::wymix(a ^ WYP[0] ^ size, b ^ WYP[1]);
+}
 
-    struct hash_header {
-        unsigned char integersize;
-        size_t signature;
-        size_t capacity;
-        size_t size;
-        size_t fill;
-        size_t valuecapacity;
-        size_t valuesize;
-    };
+// A single 128 bit multiply: sequential and strided integers spread over all the bits
+inline uint64_t mix64(uint64_t x) { return impl::wymix(x ^ WYP[0], WYP[1]); }
 
-    struct value_getter {
-        value_getter(const Self* s, const kv_pair* e): m_self{s}, m_e{e} { }
+// floor(a * b / 2^64): maps a uniform 'a' to [0, b) without a division
+inline uint64_t mulhi(uint64_t a, uint64_t b) {
+    impl::mum(a, b);
+    return b;
+}
 
-        V operator*() const {
-            assume(m_e && m_e->state == STATE_FULL);
+// Default key hasher: wyhash for strings, mix64() for integers and floating point bit patterns
+struct Hasher {
+    template<typename T>
+    static size_t hash(const T& t) {
+        if constexpr(std::is_integral_v<T>)
+            return static_cast<size_t>(impl::mix64(static_cast<uint64_t>(t)));
+        else if constexpr(std::is_floating_point_v<T>) {
+            static_assert(std::numeric_limits<T>::is_iec559, "Hasher is only defined for IEEE 754-compliant floating-point types");
 
-            V v;
-            assume(m_self->get_value(*m_e, v));
-            return v;
+            T v = t == 0 ? T{0} : t; // -0.0 == 0.0
+            uint64_t bits = 0;
+            std::memcpy(&bits, &v, sizeof(v));
+            return static_cast<size_t>(impl::mix64(bits));
         }
+        else if constexpr(std::is_same_v<T, std::string>)
+            return static_cast<size_t>(impl::wyhash(t.data(), t.size()));
+        else
+            static_assert(always_false_v<T>);
+    }
+};
 
-    private:
-        const Self* m_self;
-        const kv_pair* m_e;
-    };
+// Integers as is, fnv1a for the rest: the baseline Hasher compares against (see the hasher benchmark).
+// Tables created with it must keep being opened with it.
+struct FNV1aHasher {
+    template<typename T>
+    static size_t hash(const T& t) {
+        if constexpr(std::is_integral_v<T>) return t;
+        else if constexpr(std::is_floating_point_v<T> || std::is_same_v<T, std::string>) return impl::fnv1a(t);
+        else static_assert(always_false_v<T>);
+    }
+};
 
-    struct iterator {
-        iterator(const Self* s, const kv_pair* e, const kv_pair* ee): m_self{s}, m_e{e}, m_ende{ee} { }
-        K key() const { return m_e->key; }
-        V value() const { return *value_getter{m_self, m_e}; }
+constexpr uint32_t CRC32C_POLY = 0x82f63b78;
 
-        iterator& operator++() {
-            if(m_e != m_ende) {
-                ++m_e;
-                while(m_e != m_ende && m_e->state != STATE_FULL) ++m_e;
-            }
+// Slicing by 8: t[k][b] is the CRC of byte 'b' followed by k zero bytes
+struct crc32c_tables {
+    uint32_t t[8][256];
 
-            return *this;
+    constexpr crc32c_tables(): t{} {
+        for(uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for(size_t k = 0; k < 8; ++k) c = (c >> 1) ^ (CRC32C_POLY & (0U - (c & 1)));
+            t[0][i] = c;
         }
 
-        iterator operator++(int) {
-            iterator it = *this;
-            ++(*this);
-            return it;
+        for(size_t k = 1; k < 8; ++k) {
+            for(size_t i = 0; i < 256; ++i) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
         }
+    }
+};
 
-        std::pair<K, value_getter> operator *() const { return {m_e->key, value_getter{m_self, m_e}}; }
-        bool operator ==(const iterator& rhs) const { return m_self == rhs.m_self && m_e == rhs.m_e; }
-        bool operator !=(const iterator& rhs) const { return m_self != rhs.m_self || m_e != rhs.m_e;  }
-
-    private:
-        const Self* m_self;
-        const kv_pair *m_e, *m_ende;
-    };
+inline constexpr crc32c_tables CRC32C_TABLES{};
 
-public:
-    HashDB() = default;
-    HashDB(const std::string& name, std::string basepath = std::string{}) { this->open(name, basepath); }
-    ~HashDB() { this->close(); }
+inline uint32_t crc32c_portable(uint32_t crc, const unsigned char* p, size_t n) {
+    const auto& t = CRC32C_TABLES.t;
 
-    bool is_open() const {
-        if(m_fhashpath.empty() ||
-           m_fhash == impl::INVALID_HANDLE ||
-           m_hash == nullptr)
-            return false;
+    for( ; n >= 8; n -= 8, p += 8) {
+        uint64_t v = impl::read64(p) ^ crc;
+        crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^ t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF] ^
+              t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF] ^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+    }
 
-        if constexpr(SPLIT_VALUE) {
-            return !m_fvaluepath.empty() && 
-                   m_fhash != impl::INVALID_HANDLE &&
-                   m_hash != nullptr;
-        }
+    for( ; n; --n, ++p) crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+    return crc;
+}
 
-        return true;
-    }
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t c = crc;
+    for( ; n >= 8; n -= 8, p += 8) c = _mm_crc32_u64(c, impl::read64(p));
 
-    void close() {
-        if(m_hash) impl::munmap(m_hash, m_hash->capacity * sizeof(kv_pair));
+    crc = static_cast<uint32_t>(c);
+    for( ; n; --n, ++p) crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+inline uint32_t crc32c_arm(uint32_t crc, const unsigned char* p, size_t n) {
+    for( ; n >= 8; n -= 8, p += 8) crc = __crc32cd(crc, impl::read64(p));
+    for( ; n; --n, ++p) crc = __crc32cb(crc, *p);
+    return crc;
+}
+#endif
+
+// CRC32C (Castagnoli) of 'n' bytes, 'crc' chains a previous result. Uses the CRC instruction when the CPU has one.
+inline uint32_t crc32c(const void* data, size_t n, uint32_t crc = 0) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+
+#if defined(__x86_64__)
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    return ~(sse42 ? impl::crc32c_sse42(~crc, p, n) : impl::crc32c_portable(~crc, p, n));
+#elif defined(__ARM_FEATURE_CRC32)
+    return ~impl::crc32c_arm(~crc, p, n);
+#else
+    return ~impl::crc32c_portable(~crc, p, n);
+#endif
+}
+
+// LZ4 block format: a sequence is a token (literal count << 4 | match length - 4, 15 meaning that length bytes follow),
+// the literals, a 2 byte little endian offset and the match. The last sequence stops after its literals.
+// A dictionary virtually precedes the input: offsets may reach into it.
+constexpr size_t LZ_MIN_MATCH = 4;
+constexpr size_t LZ_LAST_LITERALS = 5;
+constexpr size_t LZ_MATCH_LIMIT = 12;
+constexpr size_t LZ_MAX_OFFSET = 65535;
+constexpr size_t LZ_HASH_BITS = 12;
+constexpr size_t LZ_DICT_HASH_BITS = 14;
+
+inline size_t lz_hash(uint64_t v, size_t bits) { return static_cast<uint32_t>(v * 2654435761U) >> (32 - bits); }
+inline size_t lz_bound(size_t n) { return n + (n / 255) + 16; }
+
+inline void lz_write_length(unsigned char*& op, size_t len) {
+    for( ; len >= 255; len -= 255) *op++ = 255;
+    *op++ = static_cast<unsigned char>(len);
+}
+
+// Positions of every 4 byte sequence of 'dict' for lz_compress(), later ones win
+inline std::vector<uint32_t> lz_index(std::string_view dict) {
+    std::vector<uint32_t> index(size_t{1} << LZ_DICT_HASH_BITS);
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(dict.data());
+
+    for(size_t i = 0; i + LZ_MIN_MATCH <= dict.size(); ++i)
+        index[impl::lz_hash(impl::read32(p + i), LZ_DICT_HASH_BITS)] = static_cast<uint32_t>(i);
+
+    return index;
+}
+
+// Greedy single probe matcher, skipping faster through incompressible input. 'dst' holds lz_bound(n) bytes.
+inline size_t lz_compress(const char* src, size_t n, char* dst, std::string_view dict = {}, const uint32_t* dictindex = nullptr) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* d = reinterpret_cast<const unsigned char*>(dict.data());
+    unsigned char* op = reinterpret_cast<unsigned char*>(dst);
+    size_t ip = 0, anchor = 0;
+
+    if(n > LZ_MATCH_LIMIT) {
+        // Positions + 1, the table only grows with the input
+        uint32_t table[size_t{1} << LZ_HASH_BITS];
+        const size_t bits = std::clamp<size_t>(64 - static_cast<size_t>(__builtin_clzll(n)), 8, LZ_HASH_BITS);
+        const size_t limit = n - LZ_MATCH_LIMIT, matchend = n - LZ_LAST_LITERALS;
+        std::fill_n(table, size_t{1} << bits, 0);
+
+        while(ip < limit) {
+            const uint64_t seq = impl::read32(in + ip);
+            uint32_t& slot = table[impl::lz_hash(seq, bits)];
+            const size_t candidate = slot;
+            size_t offset = 0, len = 0;
+            slot = static_cast<uint32_t>(ip + 1);
+
+            if(candidate && ip + 1 - candidate <= LZ_MAX_OFFSET && impl::read32(in + candidate - 1) == seq) {
+                size_t m = candidate - 1;
+
+                while(ip > anchor && m && in[ip - 1] == in[m - 1]) {
+                    --ip;
+                    --m;
+                }
+
+                offset = ip - m;
+                while(ip + len < matchend && in[m + len] == in[ip + len]) ++len;
+            }
+            else if(dictindex) {
+                const size_t m = dictindex[impl::lz_hash(seq, LZ_DICT_HASH_BITS)];
+
+                if(m + LZ_MIN_MATCH <= dict.size() && dict.size() - m + ip <= LZ_MAX_OFFSET && impl::read32(d + m) == seq) {
+                    offset = dict.size() - m + ip;
+
+                    // The match may run off the end of the dictionary into the input
+                    for( ; ip + len < matchend; ++len) {
+                        size_t v = m + len;
+                        if((v < dict.size() ? d[v] : in[v - dict.size()]) != in[ip + len]) break;
+                    }
+                }
+            }
+
+            if(len < LZ_MIN_MATCH) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            const size_t literals = ip - anchor;
+            unsigned char* token = op++;
+            *token = static_cast<unsigned char>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(len - LZ_MIN_MATCH, 15));
+            if(literals >= 15) impl::lz_write_length(op, literals - 15);
+            std::memcpy(op, in + anchor, literals);
+            op += literals;
+            *op++ = static_cast<unsigned char>(offset);
+            *op++ = static_cast<unsigned char>(offset >> 8);
+            if(len - LZ_MIN_MATCH >= 15) impl::lz_write_length(op, len - LZ_MIN_MATCH - 15);
+
+            ip += len;
+            anchor = ip;
+            if(ip < limit) table[impl::lz_hash(impl::read32(in + ip - 2), bits)] = static_cast<uint32_t>(ip - 1);
+        }
+    }
+
+    const size_t literals = n - anchor;
+    *op++ = static_cast<unsigned char>(std::min<size_t>(literals, 15) << 4);
+    if(literals >= 15) impl::lz_write_length(op, literals - 15);
+    std::memcpy(op, in + anchor, literals);
+    op += literals;
+    return static_cast<size_t>(op - reinterpret_cast<unsigned char*>(dst));
+}
+
+// Decodes exactly 'rawsize' bytes into 'dst', false on malformed input: nothing is read or written out of bounds
+inline bool lz_decompress(const char* src, size_t n, char* dst, size_t rawsize, std::string_view dict = {}) {
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* const end = ip + n;
+    char* op = dst;
+    char* const oend = dst + rawsize;
+
+    auto length = [&](size_t& len) {
+        for(;;) {
+            if(ip == end) return false;
+            unsigned char b = *ip++;
+            len += b;
+            if(b != 255) return true;
+        }
+    };
+
+    for(;;) {
+        if(ip == end) return false;
+        const unsigned char token = *ip++;
+        size_t literals = token >> 4;
+        if(literals == 15 && !length(literals)) return false;
+        if(literals > static_cast<size_t>(end - ip) || literals > static_cast<size_t>(oend - op)) return false;
+
+        std::memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if(ip == end) return op == oend;
+        if(end - ip < 2) return false;
+
+        size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8), len = token & 15;
+        ip += 2;
+        if(len == 15 && !length(len)) return false;
+        len += LZ_MIN_MATCH;
+
+        const size_t produced = static_cast<size_t>(op - dst);
+        if(!offset || offset > produced + dict.size() || len > static_cast<size_t>(oend - op)) return false;
+
+        if(offset > produced) {
+            size_t back = offset - produced, c = std::min(len, back);
+            std::memcpy(op, dict.data() + dict.size() - back, c);
+            op += c;
+            len -= c;
+        }
+
+        if(!len) continue;
+        const char* m = op - offset;
+
+        if(offset >= len)
+            std::memcpy(op, m, len);
+        else
+            for(size_t i = 0; i < len; ++i) op[i] = m[i];
+
+        op += len;
+    }
+}
+
+// The header of a packed value, both sizes are equal when compression did not pay off and the bytes are kept as is
+struct lz_frame {
+    uint32_t rawsize;
+    uint32_t packedsize;
+};
+
+inline void lz_pack(const char* data, size_t n, std::string& out, std::string_view dict = {}, const uint32_t* dictindex = nullptr) {
+    assume(n <= std::numeric_limits<uint32_t>::max());
+    out.resize(sizeof(lz_frame) + impl::lz_bound(n));
+
+    size_t packed = impl::lz_compress(data, n, out.data() + sizeof(lz_frame), dict, dictindex);
+
+    if(packed >= n) {
+        std::memcpy(out.data() + sizeof(lz_frame), data, n);
+        packed = n;
+    }
+
+    lz_frame f{static_cast<uint32_t>(n), static_cast<uint32_t>(packed)};
+    std::memcpy(out.data(), &f, sizeof(f));
+    out.resize(sizeof(f) + packed);
+}
+
+// Frames the bytes as they are, for values that are only checksummed
+inline void lz_store(const char* data, size_t n, std::string& out) {
+    assume(n <= std::numeric_limits<uint32_t>::max());
+    lz_frame f{static_cast<uint32_t>(n), static_cast<uint32_t>(n)};
+    out.resize(sizeof(f) + n);
+    std::memcpy(out.data(), &f, sizeof(f));
+    std::memcpy(out.data() + sizeof(f), data, n);
+}
+
+// Unpacks a frame of at most 'size' bytes into 'out', false if it is malformed
+inline bool lz_unpack(const char* frame, size_t size, std::string& out, std::string_view dict = {}) {
+    lz_frame f;
+    if(size < sizeof(f)) return false;
+    std::memcpy(&f, frame, sizeof(f));
+    if(f.packedsize > size - sizeof(f) || f.packedsize > f.rawsize) return false;
+
+    out.resize(f.rawsize);
+
+    if(f.packedsize == f.rawsize) {
+        std::memcpy(out.data(), frame + sizeof(f), f.rawsize);
+        return true;
+    }
+
+    return impl::lz_decompress(frame + sizeof(f), f.packedsize, out.data(), f.rawsize, dict);
+}
+
+// COVER-style training: the 8 byte substrings of 'samples' are counted, then 'samples' is cut in epochs and each one
+// gives the 64 byte segment whose substrings are the most frequent ones not taken yet. The best segments end up last,
+// where offsets are the shortest.
+inline std::string lz_train(std::string_view samples, size_t size) {
+    constexpr size_t DMER = 8, SEGMENT = 64, COUNT_BITS = 20, DMERS = SEGMENT - DMER + 1;
+    if(samples.size() <= size) return std::string{samples};
+
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(samples.data());
+    const size_t n = samples.size() - DMER + 1, epochs = std::max<size_t>(size / SEGMENT, 1), epochsize = n / epochs;
+    if(epochsize < DMERS) return std::string{samples.substr(samples.size() - size)};
+
+    std::vector<uint32_t> counts(size_t{1} << COUNT_BITS), ids(n);
+
+    for(size_t i = 0; i < n; ++i) {
+        ids[i] = static_cast<uint32_t>(impl::mix64(impl::read64(p + i)) >> (64 - COUNT_BITS));
+        ++counts[ids[i]];
+    }
+
+    std::vector<std::pair<uint64_t, size_t>> segments;
+
+    for(size_t e = 0; e < epochs; ++e) {
+        const size_t begin = e * epochsize, end = begin + epochsize;
+        uint64_t score = 0, best;
+        size_t at = begin;
+
+        for(size_t i = begin; i < begin + DMERS; ++i) score += counts[ids[i]];
+        best = score;
+
+        for(size_t i = begin + 1; i + DMERS <= end; ++i) {
+            score += counts[ids[i + DMERS - 1]];
+            score -= counts[ids[i - 1]];
+
+            if(score > best) {
+                best = score;
+                at = i;
+            }
+        }
+
+        segments.emplace_back(best, at);
+        for(size_t i = at; i < at + DMERS; ++i) counts[ids[i]] = 0;
+    }
+
+    std::stable_sort(segments.begin(), segments.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::string dict;
+    dict.reserve(segments.size() * SEGMENT);
+    for(const auto& [score, at] : segments) dict.append(samples.substr(at, SEGMENT));
+    return dict;
+}
+
+struct Serializer {
+    template<typename T, typename Reader>
+    static void deserialize(T& t, Reader r) {
+        using U = std::decay_t<T>;
+
+        if constexpr(std::is_integral_v<U> || std::is_floating_point_v<U>)
+            r(reinterpret_cast<void*>(&t), sizeof(T));
+        else if constexpr(std::is_same_v<U, std::string>) {
+            std::string::size_type size;
+            r(reinterpret_cast<void*>(&size), sizeof(std::string::size_type));
+
+            t.resize(size);
+            r(reinterpret_cast<void*>(t.data()), size);
+        }
+        else
+            t.deserialize(r);
+    }
+
+    template<typename T, typename Writer>
+    static void serialize(T&& t, Writer w) {
+        using U = std::decay_t<T>;
+
+        if constexpr(std::is_integral_v<U> || std::is_floating_point_v<U>)
+            w(reinterpret_cast<const void*>(&t), sizeof(U));
+        else if constexpr(std::is_same_v<U, std::string>) {
+            std::string::size_type size = t.size();
+            w(reinterpret_cast<const void*>(&size), sizeof(std::string::size_type));
+            w(t.c_str(), t.size());
+        }
+        else
+            t.serialize(w);
+    }
+};
+
+} // namespace impl
+
+enum hashdb_flags {
+    hashdb_flags_none       = 0,
+    hashdb_flags_split      = (1 << 0),
+    hashdb_flags_remove     = (1 << 1),
+    hashdb_flags_concurrent = (1 << 2),
+    hashdb_flags_wal        = (1 << 3),
+    hashdb_flags_bloom      = (1 << 4),
+    hashdb_flags_cache      = (1 << 5),
+    hashdb_flags_compress   = (1 << 6),
+    hashdb_flags_checksum   = (1 << 7),
+    hashdb_flags_latency    = (1 << 8),
+};
+
+// Access profiles, see HashDB::set_access()
+enum hashdb_access {
+    hashdb_access_default    = 0,
+    hashdb_access_random     = (1 << 0), // MADV_RANDOM: point lookups, no readahead around faults
+    hashdb_access_sequential = (1 << 1), // MADV_SEQUENTIAL: scans
+    hashdb_access_willneed   = (1 << 2), // MADV_WILLNEED: files are read in the background once mapped
+    hashdb_access_populate   = (1 << 3), // MAP_POPULATE: load() returns with every page faulted in
+    hashdb_access_hugepages  = (1 << 4), // MADV_HUGEPAGE on the hash file
+};
+
+// Calls of an internal operation (segment split, file growth...) and the time spent in them
+struct hashdb_timing {
+    size_t count{0};
+    std::chrono::nanoseconds time{0};
+};
+
+// Latencies of a public operation, bucket i counts the calls that took [2^i, 2^(i+1)) nanoseconds
+struct hashdb_latency {
+    static constexpr size_t BUCKETS = 40;
+
+    size_t count{0};
+    std::chrono::nanoseconds time{0};
+    std::array<size_t, BUCKETS> buckets{};
+
+    // Upper bound of the bucket where a fraction 'q' of the calls is reached
+    std::chrono::nanoseconds percentile(double q) const {
+        const double target = q * static_cast<double>(count);
+        size_t n = 0;
+
+        for(size_t i = 0; i < BUCKETS; ++i) {
+            n += buckets[i];
+            if(n && static_cast<double>(n) >= target) return std::chrono::nanoseconds{int64_t{2} << i};
+        }
+
+        return std::chrono::nanoseconds{0};
+    }
+};
+
+// Returned by HashDB::stats(), operation counters cover the time since the table was opened (or reset_stats())
+struct hashdb_stats {
+    size_t size{0};
+    size_t capacity{0};
+    size_t fill{0};       // Full slots and tombstones
+    size_t tombstones{0}; // fill - size
+    size_t segments{0};
+    size_t globaldepth{0};
+    std::vector<size_t> probes; // probes[i]: entries stored i groups past their home group
+
+    size_t valuecapacity{0};
+    size_t valuelive{0};
+    size_t valuedead{0};      // Allocated once, no longer referenced
+    size_t valuefree{0};      // Dead bytes allocations can reuse without compaction
+    size_t valuereclaimed{0}; // Left out of 'valuedead': drained by compact() and released to the file system, not written since
+    size_t keycapacity{0};
+    size_t keylive{0};
+    size_t keydead{0};
+
+    hashdb_timing splits, purges, rehashes, collections, compactions;
+    hashdb_timing extendhash, extendvalue, extendkey;
+    hashdb_latency get, contains, set, erase; // hashdb_flags_latency
+
+    float load_factor() const { return capacity ? static_cast<float>(fill) / static_cast<float>(capacity) : 0; }
+    float tombstone_ratio() const { return capacity ? static_cast<float>(tombstones) / static_cast<float>(capacity) : 0; }
+
+    // Groups a successful lookup compares on average
+    double mean_probes() const {
+        size_t n = 0, groups = 0;
+
+        for(size_t i = 0; i < probes.size(); ++i) {
+            n += probes[i];
+            groups += probes[i] * (i + 1);
+        }
+
+        return n ? static_cast<double>(groups) / static_cast<double>(n) : 0;
+    }
+};
+
+// Layout:
+// - The hash file is a header followed by segments of SEGMENT_SLOTS slots (extendible hashing), then the directory.
+// - The low 'globaldepth' bits of a hash select a directory entry, pointing to a segment.
+// - A segment of local depth 'd' is shared by 2^(globaldepth - d) directory entries:
+//   when it fills up it is split in two, the directory doubles only when d == globaldepth.
+// - The directory has room for DIRECTORY_RATIO entries per segment the file can hold and moves past
+//   the new last segment whenever the file grows, so the header keeps a fixed, small size.
+// - A segment is a small header (fill and local depth), a control byte array and its slots: a control byte
+//   is either empty, a tombstone or 0x80 | 7 bits of the hash, so a probe compares 16 control bytes at once
+//   and only touches the slots whose bits match. Groups of 16 are probed linearly starting from the hash bits above 'd'.
+// - Serialized values of up to INLINE_VALUE bytes stay in the slot, with their size in a length byte.
+//   Larger ones live in extents of the value file rounded up to a power of two size class.
+//   Extents released by updates and erasures are pushed to per-class free lists (heads in hash_header,
+//   links in the extents themselves) and reused before the file grows.
+// - The value file is also split in regions (at most VALUE_REGIONS, doubling in size as the file grows)
+//   whose live bytes are kept in hash_header. compact() drains the emptiest region a few bytes at a time:
+//   its free extents are unlinked, its live extents packed into the arena, then the region is hole punched
+//   and set aside until the arena runs out: it becomes the next one, carved before the file grows.
+//   The last region goes first when it qualifies: draining it ends the file there instead, so deleting most keys
+//   shrinks the used part of the file region by region. The mapping (and the file size) keep their capacity.
+// - Every slot keeps the full hash of its key: probes compare it before the key and splits never rehash.
+// - std::string keys keep their size and first KEY_PREFIX bytes in the slot: the key file ('<name>.key')
+//   only holds the rest of longer keys, in size classed extents with their own free lists.
+//   A lookup only reads it once hash, size and prefix all match. collect_garbage() rewrites it too.
+// - A segment that reaches SEGMENT_FILL with a quarter of its slots in tombstones is rebuilt in place instead of split.
+//
+// Concurrency (hashdb_flags_concurrent):
+// - One writer thread calls set(), erase(), clear(), rehash(), compact() and collect_garbage(). The last one builds
+//   the new files aside, then publishes their mappings the same way a file growth does.
+// - Any number of reader threads call get(), contains(), multi_get() and multi_contains() without locking.
+// - In-place mutations (segment splits included) are wrapped by a seqlock ('sequence' in hash_header):
+//   readers copy the slot (and the serialized value) and retry if the sequence changed.
+// - Growing a file never touches the mappings readers may be using:
+//   a new mapping is published and the old one retired until no reader is active.
+// - Iterators, for_each_parallel(), reduce_parallel(), get_view(), stats() and verify() read the mappings without
+//   the seqlock: they are only safe while no write is in progress.
+//
+// Write-ahead log (hashdb_flags_wal):
+// - set(), erase() and clear() append a record to '<name>.wal' and are kept in memory until their batch commits.
+// - A batch (see set_group_commit()) is written and synced with a single fdatasync, then applied to the main files.
+// - The hash file is mapped privately, so a crash (even in the middle of a segment split) always reopens
+//   the last checkpoint and replays the log. checkpoint() finds the pages written since the last one
+//   (/proc/self/pagemap), writes and syncs them to '<name>.hash.ckpt', writes them in place, then truncates the log:
+//   a checkpoint costs twice the dirty pages, whatever the size of the table. Until then dirty pages are private memory,
+//   set_checkpoint_size() bounds the log (WAL_CHECKPOINT_SIZE by default) and with it how many of them build up.
+// - collect_garbage() builds new files aside and commits their rename through the log.
+// - Moves done by compact() are not logged: a drained region is only reused once a checkpoint stopped referencing it.
+// - get(), contains() and get_cached() see the pending batch. size(), empty(), iterators, stats(), get_view(),
+//   for_each_parallel() and reduce_parallel() commit it first, so calling them between writes costs a sync each time.
+//   Concurrent readers only see committed batches.
+//
+// Bloom filter (hashdb_flags_bloom):
+// - '<name>.bloom' is a blocked Bloom filter over the key hashes: a block is one cache line and a key sets
+//   one bit in each of its words. Lookups check it first, so most misses never touch the slots.
+// - Bits are only ever set. The filter is rebuilt from the slot hashes when it is outgrown,
+//   and by clear(), rehash() and collect_garbage(), which drops the bits of erased keys.
+// - It is marked dirty while the table is open, a filter that was not closed cleanly is rebuilt on load.
+//
+// Cache mode (hashdb_flags_cache):
+// - Every slot carries an expiry (seconds since the epoch, 0 never expires) from set(k, v, ttl) or set_ttl().
+//   Lookups and iterators skip expired entries.
+// - A timing wheel of WHEEL_SLOTS one second ticks marks the segments holding entries due at each tick:
+//   expire() sweeps the due segments, set() sweeps one of them.
+// - set_limits() bounds the entries and their bytes (slots, values and keys). Past either limit set() evicts:
+//   a CLOCK hand walks the slots, taking expired entries and those no lookup referenced since its last pass.
+// - Reference bits and the wheel live in memory: a loaded table starts cold and has every segment due once.
+//
+// Compression (hashdb_flags_compress):
+// - Values that spill to the value file are packed with an LZ4 block codec (impl::lz_compress()) behind an lz_frame
+//   holding both sizes. Inline values are kept as is.
+// - The flag makes every table split: trivially copyable values that would be stored as is in the slot are serialized
+//   into a split_value instead, a larger slot that every read deserializes.
+// - The hash header ends with a shared dictionary of up to DICTIONARY_SIZE bytes: small records mostly repeat
+//   each other, so their matches are found in the dictionary rather than in themselves.
+// - build() trains the dictionary from its input. train_dictionary() trains it from the values of the table,
+//   then rewrites the value file like collect_garbage() does, repacking every value with it.
+//
+// Checksums (hashdb_flags_checksum):
+// - Every slot keeps the CRC32C of its stored value bytes in the padding of split_value, so slots do not grow.
+//   Values kept unserialized in the slot (trivially copyable, up to InlineSize) stay so, with their CRC32C after them:
+//   those slots grow by 8 bytes.
+//   Spilled values are stored behind an lz_frame even when uncompressed: its sizes bound the checksummed bytes,
+//   which are checked before anything is deserialized from them.
+// - Every read of a value checks it and aborts on a mismatch. verify() checks the whole table in parallel.
+//
+// Statistics:
+// - stats() scans the slots for the probe length histogram and reports the live and dead bytes of each file,
+//   with the count and duration of splits, purges, rehash(), garbage collections, compact() steps and file growths.
+//   Counters live in memory and start over when the table is opened.
+// - hashdb_flags_latency also times get(), contains(), set() and erase() into log2 histograms,
+//   without it the clock is never read.
+//
+// Access profiles (hashdb_access):
+// - Mappings take the kernel's default advice unless a profile is given to the constructor, load() or set_access().
+//   It is applied again whenever a file is remapped (growth, collect_garbage()).
+// - warmup() faults the whole table in from several threads, so the first lookups after a restart do not pay for it.
+//
+// Asynchronous reads (set_io_depth()):
+// - Faulting the value mapping in blocks on one page at a time. get_async() reads the extent of a value with
+//   io_uring instead: reads are queued in the submission ring and submitted together, keeping up to 'depth'
+//   of them in flight, and the callback deserializes the value from the bytes read.
+// - The rings are set up with raw syscalls, without liburing. Where io_uring is missing the reads use pread().
+
+template<typename K, typename V, typename Serializer, typename Hasher>
+class FrozenHashDB;
+
+// 'Hasher' decides where keys are stored: a file must always be opened with the one that created it.
+// Trivially copyable values of up to 'InlineSize' bytes are stored as is in the slot, others are serialized:
+// up to 'InlineSize' bytes (at least 16) they are still kept in the slot, the rest goes to the value file.
+template<typename K, typename V, size_t Flags = hashdb_flags_none, typename Serializer = impl::Serializer, typename Hasher = impl::Hasher, size_t InlineSize = 32>
+class HashDB
+{
+    using Self = HashDB<K, V, Flags, Serializer, Hasher, InlineSize>;
+
+    static_assert(InlineSize < 255, "InlineSize must fit the inline length byte");
+
+    static constexpr bool SPLIT_VALUE = (Flags & (hashdb_flags_split | hashdb_flags_compress)) || !std::is_trivially_copyable_v<V> || (sizeof(V) > InlineSize);
+    static constexpr size_t INLINE_VALUE = std::max<size_t>(InlineSize, 2 * sizeof(size_t));
+    static constexpr unsigned char SPILLED_VALUE = 0xFF;
+    static constexpr bool CONCURRENT = Flags & hashdb_flags_concurrent;
+    static constexpr bool WAL = Flags & hashdb_flags_wal;
+    static constexpr bool BLOOM = Flags & hashdb_flags_bloom;
+    static constexpr bool CACHE = Flags & hashdb_flags_cache;
+    static constexpr bool COMPRESS = Flags & hashdb_flags_compress;
+    static constexpr bool CHECKSUM = Flags & hashdb_flags_checksum;
+    static constexpr bool FRAMED = COMPRESS || (CHECKSUM && SPLIT_VALUE);
+    static constexpr bool LATENCY = Flags & hashdb_flags_latency;
+    static constexpr bool STRING_KEY = std::is_same_v<K, std::string>;
+    static constexpr size_t KEY_PREFIX = 12;
+    static constexpr size_t DEFAULT_GROUP_COMMIT = 64;
+    static constexpr size_t WAL_CHECKPOINT_SIZE = 64 * 1024 * 1024;
+    static constexpr size_t SIGNATURE = 0x5d1b0239;
+    static constexpr size_t VERSION = 10;
+    static constexpr size_t DEFAULT_ITEMS_COUNT = 4096;
+    static constexpr float MAX_FILL_CAPACITY = 0.75;
+    static constexpr size_t SEGMENT_SLOTS = DEFAULT_ITEMS_COUNT;
+    static constexpr size_t SEGMENT_FILL = static_cast<size_t>(SEGMENT_SLOTS * MAX_FILL_CAPACITY);
+    static constexpr size_t MAX_DEPTH = 16;
+    static constexpr size_t MAX_SEGMENTS = size_t{1} << MAX_DEPTH;
+    static constexpr size_t DIRECTORY_RATIO = 4;
+
+    static constexpr size_t SEGMENT_GROUPS = SEGMENT_SLOTS / impl::GROUP_SIZE;
+    static constexpr size_t MIN_EXTENT_BITS = 4;
+    static constexpr size_t VALUE_CLASSES = (sizeof(size_t) * 8) - MIN_EXTENT_BITS;
+    static constexpr size_t VALUE_REGIONS = 4096;
+    static constexpr size_t REGION_RECLAIMED = std::numeric_limits<size_t>::max();
+    static constexpr size_t MIN_REGION_BITS = 20;
+    static constexpr float MAX_COMPACT_LIVE = 0.5;
+    static constexpr size_t COMPACT_SCAN_COST = 64;
+    static constexpr size_t PIPELINE_DISTANCE = 8;
+    static constexpr size_t WARMUP_CHUNK = 4 * 1024 * 1024;
+    static constexpr size_t NO_SLOT = std::numeric_limits<size_t>::max();
+    static constexpr size_t WHEEL_SLOTS = 256;
+    static constexpr size_t REFERENCED_SIZE = (MAX_SEGMENTS * SEGMENT_SLOTS) / 8;
+    static constexpr size_t DICTIONARY_SIZE = 16 * 1024;
+    static constexpr size_t DICTIONARY_SAMPLE = 64 * DICTIONARY_SIZE;
+    static constexpr size_t BLOOM_SIGNATURE = 0x5d1b023b;
+    static constexpr size_t CHECKPOINT_SIGNATURE = 0x5d1b023c;
+    static constexpr size_t CHECKPOINT_RUN = 1024 * 1024;
+    static constexpr size_t BLOOM_BITS_PER_KEY = 16;
+    static constexpr size_t BLOOM_WORDS = 8;
+    static constexpr uint32_t BLOOM_SALT[BLOOM_WORDS] = {0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d, 0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31};
+
+    static_assert((SEGMENT_SLOTS & (SEGMENT_SLOTS - 1)) == 0, "SEGMENT_SLOTS must be a power of two");
+    static_assert(SEGMENT_SLOTS % impl::GROUP_SIZE == 0, "SEGMENT_SLOTS must be a multiple of the group size");
+
+    enum : unsigned char {
+        CTRL_EMPTY = 0,
+        CTRL_TOMBSTONE = 1,
+        CTRL_FULL = 0x80,
+    };
+
+    enum : unsigned char {
+        COMPACT_IDLE = 0,
+        COMPACT_PURGE,
+        COMPACT_EVACUATE,
+        COMPACT_RECLAIM,
+    };
+
+    enum : unsigned char {
+        EVENT_SPLIT = 0,
+        EVENT_PURGE,
+        EVENT_REHASH,
+        EVENT_COLLECT,
+        EVENT_COMPACT,
+        EVENT_EXTEND_HASH,
+        EVENT_EXTEND_VALUE,
+        EVENT_EXTEND_KEY,
+        EVENTS,
+    };
+
+    enum : unsigned char {
+        LATENCY_GET = 0,
+        LATENCY_CONTAINS,
+        LATENCY_SET,
+        LATENCY_ERASE,
+        LATENCIES,
+    };
+
+    enum : unsigned char {
+        OP_SET = 1,
+        OP_ERASE,
+        OP_CLEAR,
+        OP_GC,
+        OP_COMPACT,
+    };
+
+    struct wal_record {
+        uint32_t size;
+        uint32_t checksum;
+    };
+
+    // '<name>.hash.ckpt': this header, then 'runs' times a checkpoint_run followed by its bytes
+    struct checkpoint_header {
+        size_t signature;
+        size_t runs;
+        size_t hashsize;
+    };
+
+    struct checkpoint_run {
+        size_t offset;
+        size_t size;
+        uint32_t checksum;
+    };
+
+    struct hash_offset_value {
+        size_t capacity;
+        size_t offset;
+    };
+
+    // Keys longer than KEY_PREFIX store their tail at 'offset' in the key file
+    struct string_key {
+        uint32_t size;
+        char prefix[KEY_PREFIX];
+        size_t offset;
+    };
+
+    using stored_key = std::conditional_t<STRING_KEY, string_key, K>;
+
+    // Serialized values of up to INLINE_VALUE bytes overlap the extent they would otherwise need
+    struct split_value {
+        union {
+            hash_offset_value extent;
+            char data[INLINE_VALUE];
+        };
+
+        unsigned char size; // Inline size or SPILLED_VALUE
+        uint32_t checksum;  // hashdb_flags_checksum, it takes what used to be padding
+
+        bool spilled() const { return size == SPILLED_VALUE; }
+    };
+
+    struct kv_entry {
+        size_t hash;
+        stored_key key;
+        std::conditional_t<SPLIT_VALUE, split_value, V> value;
+    };
+
+    // Unserialized values keep their checksum after them
+    struct kv_checked: kv_entry {
+        uint32_t checksum;
+    };
+
+    using kv_slot = std::conditional_t<CHECKSUM && !SPLIT_VALUE, kv_checked, kv_entry>;
+
+    struct kv_expiring: kv_slot {
+        uint64_t expiry;
+    };
+
+    using kv_pair = std::conditional_t<CACHE, kv_expiring, kv_slot>;
+
+    // In-memory progress of compact(): 'cls'/'prev' walk the free lists, 'cursor' walks the slots
+    struct compaction {
+        unsigned char phase{COMPACT_IDLE};
+        size_t region{0};
+        size_t cls{0};
+        size_t prev{0};
+        size_t cursor{0};
+    };
+
+    // Leads every segment, before its control bytes
+    struct segment_header {
+        uint32_t fill;
+        unsigned char depth;
+    };
+
+    struct slot_ref {
+        unsigned char* ctrl{nullptr};
+        kv_pair* kv{nullptr};
+
+        bool full() const { return ctrl && (*ctrl & CTRL_FULL); }
+    };
+
+    // A deserialized value kept by set_cache(), 'slot' is the offset of its control byte (NO_SLOT once evicted)
+    struct cache_entry {
+        size_t slot;
+        size_t bytes;
+        bool referenced;
+        V value;
+    };
+
+    // A get_async() waiting for its extent, 'tag' of its io_uring read is its index in m_reads
+    struct async_read {
+        K key;
+        split_value value;
+        std::string data;
+        std::function<void(const K&, std::optional<V>)> callback;
+    };
+
+    struct table_header {
+        unsigned char integersize;
+        size_t signature;
+        size_t version;
+        size_t capacity;
+        size_t size;
+        size_t fill;
+        size_t valuecapacity;
+        size_t valuesize;
+        size_t sequence;
+        size_t globaldepth;
+        size_t segments;
+        size_t segmentcapacity;
+        size_t valuefree;
+        size_t freelist[VALUE_CLASSES];
+        size_t keycapacity;
+        size_t keysize;
+        size_t keyfree;
+        size_t keylist[VALUE_CLASSES];
+        size_t regionbits;
+        size_t arenaoffset;
+        size_t arenaend;
+        size_t regionlive[VALUE_REGIONS];
+    };
+
+    struct compressed_header: table_header {
+        size_t dictsize;
+        char dictionary[DICTIONARY_SIZE];
+    };
+
+    using hash_header = std::conditional_t<COMPRESS, compressed_header, table_header>;
+
+    struct alignas(64) bloom_header {
+        size_t signature;
+        size_t blocks;
+        size_t capacity; // Keys it was sized for
+        size_t dirty;
+    };
+
+    struct alignas(64) bloom_block {
+        uint64_t words[BLOOM_WORDS];
+    };
+
+    struct reader_guard {
+        explicit reader_guard(const Self* s): m_self{s} { if constexpr(CONCURRENT) impl::atomic_add(m_self->m_readers, size_t{1}); }
+        ~reader_guard() { if constexpr(CONCURRENT) impl::atomic_add(m_self->m_readers, size_t(-1)); }
+
+    private:
+        const Self* m_self;
+    };
+
+    struct writer_guard {
+        explicit writer_guard(Self* s): m_self{s} {
+            if constexpr(CONCURRENT) {
+                impl::atomic_store_relaxed(m_self->m_hash->sequence, m_self->m_hash->sequence + 1);
+                impl::atomic_fence_release();
+            }
+        }
+
+        ~writer_guard() {
+            if constexpr(CONCURRENT) {
+                impl::atomic_store(m_self->m_hash->sequence, m_self->m_hash->sequence + 1);
+                m_self->reclaim();
+            }
+        }
+
+    private:
+        Self* m_self;
+    };
+
+    struct latency_counter {
+        uint64_t count;
+        uint64_t time;
+        uint64_t buckets[hashdb_latency::BUCKETS];
+    };
+
+    // Adds the time until its destruction to one of the event counters
+    struct event_timer {
+        event_timer(Self* s, unsigned char event): m_self{s}, m_event{event}, m_start{std::chrono::steady_clock::now()} { }
+
+        ~event_timer() {
+            hashdb_timing& t = m_self->m_events[m_event];
+            ++t.count;
+            t.time += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+        }
+
+    private:
+        Self* m_self;
+        unsigned char m_event;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    // Same for the latency histograms, readers may record concurrently
+    struct latency_timer {
+        latency_timer(const Self* s, unsigned char op): m_self{s}, m_op{op} {
+            if constexpr(LATENCY) m_start = std::chrono::steady_clock::now();
+        }
+
+        ~latency_timer() {
+            if constexpr(LATENCY) {
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+                uint64_t n = static_cast<uint64_t>(std::max<int64_t>(ns, 1));
+                latency_counter& c = m_self->m_latency[m_op];
+                size_t b = std::min<size_t>(63 - static_cast<size_t>(__builtin_clzll(n)), hashdb_latency::BUCKETS - 1);
+
+                impl::atomic_add_relaxed(c.count, uint64_t{1});
+                impl::atomic_add_relaxed(c.time, n);
+                impl::atomic_add_relaxed(c.buckets[b], uint64_t{1});
+            }
+        }
+
+    private:
+        const Self* m_self;
+        unsigned char m_op;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    struct value_getter {
+        value_getter(const Self* s, const kv_pair* e): m_self{s}, m_e{e} { }
+
+        V operator*() const {
+            assume(m_e);
+
+            V v;
+            m_self->get_value(*m_e, v);
+            return v;
+        }
+
+    private:
+        const Self* m_self;
+        const kv_pair* m_e;
+    };
+
+    struct iterator {
+        iterator(const Self* s, size_t i, size_t ei): m_self{s}, m_i{i}, m_endi{ei}, m_now{CACHE ? Self::now() : 0} { this->skip(); }
+        K key() const { return m_self->load_key(this->get_kvpair()->key); }
+        V value() const { return *value_getter{m_self, this->get_kvpair()}; }
+
+        iterator& operator++() {
+            if(m_i != m_endi) {
+                ++m_i;
+                this->skip();
+            }
+
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator it = *this;
+            ++(*this);
+            return it;
+        }
+
+        std::pair<K, value_getter> operator *() const { return {this->key(), value_getter{m_self, this->get_kvpair()}}; }
+        bool operator ==(const iterator& rhs) const { return m_self == rhs.m_self && m_i == rhs.m_i; }
+        bool operator !=(const iterator& rhs) const { return m_self != rhs.m_self || m_i != rhs.m_i;  }
+
+    private:
+        const kv_pair* get_kvpair() const { return Self::get_slots(m_self->m_hash, m_i / SEGMENT_SLOTS) + (m_i % SEGMENT_SLOTS); }
+
+        void skip() {
+            while(m_i != m_endi && (!(Self::get_control(m_self->m_hash, m_i / SEGMENT_SLOTS)[m_i % SEGMENT_SLOTS] & CTRL_FULL) ||
+                                    Self::expired(*this->get_kvpair(), m_now)))
+                ++m_i;
+        }
+
+        const Self* m_self;
+        size_t m_i, m_endi;
+        uint64_t m_now;
+    };
+
+public:
+    HashDB() = default;
+    HashDB(const std::string& name, std::string basepath = std::string{}, size_t access = hashdb_access_default) { this->open(name, basepath, access); }
+    ~HashDB() { this->close(); }
+
+    bool is_open() const {
+        if(m_fhashpath.empty() ||
+           m_fhash == impl::INVALID_HANDLE ||
+           m_hash == nullptr)
+            return false;
+
+        if constexpr(SPLIT_VALUE) {
+            if(m_fvaluepath.empty() ||
+               m_fvalue == impl::INVALID_HANDLE ||
+               m_value == nullptr)
+                return false;
+        }
+
+        if constexpr(BLOOM) {
+            if(m_fbloompath.empty() ||
+               m_fbloom == impl::INVALID_HANDLE ||
+               m_bloom == nullptr)
+                return false;
+        }
+
+        if constexpr(STRING_KEY) {
+            return !m_fkeypath.empty() &&
+                   m_fkey != impl::INVALID_HANDLE &&
+                   m_key != nullptr;
+        }
+
+        return true;
+    }
+
+    void close() {
+        if constexpr(WAL) {
+            if(m_hash) this->checkpoint();
+            if(m_fwal != impl::INVALID_HANDLE) impl::close(m_fwal);
+            m_fwal = impl::INVALID_HANDLE;
+        }
+
+        if constexpr(SPLIT_VALUE && !CONCURRENT) this->wait_async();
+
+        for(const auto& [m, size] : m_retired) impl::munmap(m, size);
+        m_retired.clear();
+        this->clear_cache();
+
+        if(m_referenced) impl::munmap(m_referenced, REFERENCED_SIZE);
+        m_referenced = nullptr;
+        m_wheel.clear();
+
+        if(m_bloom) {
+            size_t size = Self::bloom_size(m_bloom->blocks);
+            impl::msync(m_bloom, size);
+            this->mark_bloom(false);
+            impl::munmap(m_bloom, size);
+        }
+
+        if(m_value) impl::munmap(m_value, m_hash->valuecapacity);
+        if(m_key) impl::munmap(m_key, m_hash->keycapacity);
+        if(m_hash) impl::munmap(m_hash, Self::hash_size(m_hash->segmentcapacity));
         if(m_fhash != impl::INVALID_HANDLE) impl::close(m_fhash);
         if(m_fvalue != impl::INVALID_HANDLE) impl::close(m_fvalue);
+        if(m_fkey != impl::INVALID_HANDLE) impl::close(m_fkey);
+        if(m_fbloom != impl::INVALID_HANDLE) impl::close(m_fbloom);
+
+        m_hash = nullptr;
+        m_value = nullptr;
+        m_key = nullptr;
+        m_bloom = nullptr;
+        m_fhash = impl::INVALID_HANDLE;
+        m_fvalue = impl::INVALID_HANDLE;
+        m_fkey = impl::INVALID_HANDLE;
+        m_fbloom = impl::INVALID_HANDLE;
+
+        if constexpr(Flags & hashdb_flags_remove) {
+            if(!m_fvaluepath.empty()) std::remove(m_fvaluepath.c_str());
+            if(!m_fkeypath.empty()) std::remove(m_fkeypath.c_str());
+            if(!m_fhashpath.empty()) std::remove(m_fhashpath.c_str());
+            if(!m_fwalpath.empty()) std::remove(m_fwalpath.c_str());
+            if(!m_fhashpath.empty()) std::remove((m_fhashpath + impl::CHECKPOINT_SUFFIX).c_str());
+            if(!m_fbloompath.empty()) std::remove(m_fbloompath.c_str());
+            m_fvaluepath.clear();
+            m_fkeypath.clear();
+            m_fhashpath.clear();
+            m_fwalpath.clear();
+            m_fbloompath.clear();
+        }
+    }
+
+    void open(const std::string& name, std::string basepath = std::string{}, size_t access = hashdb_access_default) {
+        assume(!name.empty());
+        if(!basepath.empty()) basepath.append(impl::PATH_SEPARATOR);
+        m_access = access;
+
+        m_fhashpath = basepath + name + impl::HASH_SUFFIX;
+        this->reinit_hashfile();
+
+        m_hash->integersize = sizeof(size_t);
+        m_hash->signature = SIGNATURE;
+        m_hash->version = VERSION;
+        m_hash->capacity = SEGMENT_SLOTS;
+        m_hash->valuesize = 0;
+        m_hash->size = 0;
+        m_hash->fill = 0;
+        m_hash->valuefree = 0;
+        m_hash->sequence = 0;
+        m_hash->globaldepth = 0;
+        m_hash->segments = 1;
+        m_hash->segmentcapacity = 1;
+        m_hash->regionbits = MIN_REGION_BITS;
+        m_compaction = {};
+
+        if constexpr(SPLIT_VALUE) {
+            m_fvaluepath = basepath + name + impl::VALUE_SUFFIX;
+            m_hash->valuecapacity = DEFAULT_ITEMS_COUNT * sizeof(V);
+            this->reinit_valuefile(m_hash->valuecapacity);
+        }
+        else
+            m_hash->valuecapacity = 0;
+
+        if constexpr(STRING_KEY) {
+            m_fkeypath = basepath + name + impl::KEY_SUFFIX;
+            m_hash->keycapacity = DEFAULT_ITEMS_COUNT * KEY_PREFIX;
+            this->reinit_keyfile(m_hash->keycapacity);
+        }
+
+        if constexpr(BLOOM) {
+            m_fbloompath = basepath + name + impl::BLOOM_SUFFIX;
+            this->rebuild_bloom();
+        }
+
+        if constexpr(CACHE) this->init_cache_mode();
+
+        if constexpr(WAL) {
+            m_fwalpath = basepath + name + impl::WAL_SUFFIX;
+            m_fwal = impl::open(m_fwalpath);
+            assume(m_fwal != impl::INVALID_HANDLE);
+            impl::resize(m_fwal, 0);
+            m_hashdirty = true;
+            this->checkpoint();
+        }
+
+        this->apply_access();
+    }
+
+    iterator begin() const {
+        this->commit_pending();
+        return iterator{this, 0, m_hash->capacity};
+    }
+
+    iterator end() const {
+        this->commit_pending();
+        return iterator{this, m_hash->capacity, m_hash->capacity};
+    }
+
+    // Calls f(key, value) for every entry from 'threads' workers (0: one per core), with the same guarantees as iterators.
+    // Workers claim one segment at a time: 'f' runs concurrently and in no particular order.
+    template<typename Function>
+    void for_each_parallel(Function f, size_t threads = 0) const {
+        this->scan_parallel(this->scan_threads(threads), [&](size_t, const kv_pair& e, const V& v) { f(this->load_key(e.key), v); });
+    }
+
+    // Folds every entry with acc = f(acc, key, value) into one accumulator per worker, then folds those with acc = merge(acc, acc).
+    // Each worker starts from 'init', which should be the identity of 'merge'.
+    template<typename T, typename Function, typename Merge>
+    T reduce_parallel(T init, Function f, Merge merge, size_t threads = 0) const {
+        threads = this->scan_threads(threads);
+        std::vector<T> acc(threads, init);
+
+        this->scan_parallel(threads, [&](size_t t, const kv_pair& e, const V& v) {
+            acc[t] = f(std::move(acc[t]), this->load_key(e.key), v);
+        });
+
+        T res = std::move(acc[0]);
+        for(size_t t = 1; t < threads; ++t) res = merge(std::move(res), std::move(acc[t]));
+        return res;
+    }
+
+    float load_factor() const { return static_cast<float>(m_hash->fill) / static_cast<float>(m_hash->capacity); }
+    size_t capacity() const { return m_hash->capacity; }
+    size_t size() const {
+        this->commit_pending();
+        return m_hash->size;
+    }
+
+    bool empty() const { return this->size() == 0; }
+
+    bool contains(const K& k) const {
+        latency_timer t{this, LATENCY_CONTAINS};
+        return this->contains_hashed(this->hash(k), k);
+    }
+
+    // Looks up every key of a contiguous range (see multi_get())
+    template<typename Keys, typename Function>
+    void multi_contains(const Keys& keys, Function f) const { this->multi_contains(std::data(keys), std::size(keys), f); }
+
+    // Calls f(key, found) for each key, in order
+    template<typename Function>
+    void multi_contains(const K* keys, size_t n, Function f) const {
+        this->pipeline(keys, n, [&](size_t h, const K& k) { f(k, this->contains_hashed(h, k)); });
+    }
+
+    void clear() {
+        if constexpr(WAL) {
+            m_pending.clear();
+            m_pendingexpiry.clear();
+            m_wrecords = 0;
+            m_walbuffer.clear();
+            this->log_record(OP_CLEAR);
+            this->commit();
+        }
+        else
+            this->clear_entries();
+    }
+
+    void erase(const K& k) {
+        latency_timer t{this, LATENCY_ERASE};
+
+        if constexpr(WAL) {
+            m_pending[k] = std::nullopt;
+            this->log_record(OP_ERASE, &k);
+            if(++m_wrecords >= m_groupcommit) this->commit();
+        }
+        else
+            this->erase_entry(k);
+
+        if constexpr(SPLIT_VALUE) {
+            if(m_compactbudget) this->compact(m_compactbudget);
+        }
+    }
+
+    void set(const K& k, const V& v) { this->put(k, v, this->default_expiry()); }
+    void set(const K& k, V&& v) { this->set(k, static_cast<const V&>(v)); }
+
+    // Cache mode: 'k' expires once 'ttl' has passed (0s never expires)
+    void set(const K& k, const V& v, std::chrono::seconds ttl) {
+        static_assert(CACHE, "set() with a TTL requires hashdb_flags_cache");
+        this->put(k, v, Self::expiry_after(ttl));
+    }
+
+    // Cache mode: TTL of the entries stored without one (0s never expires)
+    void set_ttl(std::chrono::seconds ttl) {
+        static_assert(CACHE, "set_ttl() requires hashdb_flags_cache");
+        m_ttl = ttl;
+    }
+
+    // Cache mode: most entries and bytes (slots, values and keys) kept before set() evicts, 0 is unbounded
+    void set_limits(size_t items, size_t bytes = 0) {
+        static_assert(CACHE, "set_limits() requires hashdb_flags_cache");
+        m_maxitems = items;
+        m_maxbytes = bytes;
+
+        writer_guard g{this};
+        this->enforce_limits();
+    }
+
+    // Cache mode: removes the expired entries of up to 'budget' segments due on the timing wheel, returns how many
+    size_t expire(size_t budget = std::numeric_limits<size_t>::max()) {
+        static_assert(CACHE, "expire() requires hashdb_flags_cache");
+        const uint64_t now = Self::now();
+        size_t removed = 0;
+
+        // A whole turn went by: every bucket is due once
+        if(now >= m_wheeltick + WHEEL_SLOTS) {
+            m_wheeltick = now - WHEEL_SLOTS + 1;
+            m_wheelcursor = 0;
+        }
+
+        while(budget && m_wheeltick <= now) {
+            std::vector<uint64_t>& bucket = m_wheel[m_wheeltick % WHEEL_SLOTS];
+            size_t w = m_wheelcursor / 64;
+            uint64_t bits = w < bucket.size() ? bucket[w] & (~uint64_t{0} << (m_wheelcursor % 64)) : 0;
+
+            while(!bits && ++w < bucket.size()) bits = bucket[w];
+
+            if(!bits) {
+                ++m_wheeltick;
+                m_wheelcursor = 0;
+                continue;
+            }
+
+            size_t seg = (w * 64) + static_cast<size_t>(__builtin_ctzll(bits));
+            bucket[w] &= ~(uint64_t{1} << (seg % 64));
+            m_wheelcursor = seg + 1;
+            removed += this->sweep_segment(seg, now);
+            --budget;
+        }
+
+        return removed;
+    }
+
+    // Inserts or updates every (key, value) pair of a range (std::vector<std::pair<K, V>>, std::map...).
+    // Both files are grown once for the whole batch, split values are serialized into a single buffer
+    // and the log (if any) commits the batch with one sync.
+    template<typename Items>
+    void set_many(const Items& items) {
+        const uint64_t expiry = this->default_expiry();
+        size_t count = 0;
+
+        if constexpr(WAL) {
+            for(const auto& [k, v] : items) {
+                m_pending[k] = v;
+                if constexpr(CACHE) m_pendingexpiry[k] = expiry;
+                this->log_record(OP_SET, &k, &v, expiry);
+                ++count;
+            }
+
+            this->commit();
+        }
+        else if constexpr(SPLIT_VALUE) {
+            size_t valuebytes = 0;
+            m_wbuffer.clear();
+            m_wsizes.clear();
+
+            for(const auto& [k, v] : items) {
+                size_t n = m_wbuffer.size();
+                Self::serialize_value(v, m_wbuffer);
+                m_wsizes.push_back(m_wbuffer.size() - n);
+                if(m_wsizes.back() > INLINE_VALUE) valuebytes += Self::class_size(Self::value_class(m_wsizes.back()));
+            }
+
+            count = m_wsizes.size();
+            this->reserve_entries(count, valuebytes);
+            const char* p = m_wbuffer.data();
+            size_t i = 0;
+
+            for(const auto& [k, v] : items) {
+                this->store_entry(k, nullptr, p, m_wsizes[i], expiry);
+                p += m_wsizes[i++];
+            }
+        }
+        else {
+            count = static_cast<size_t>(std::distance(std::begin(items), std::end(items)));
+            this->reserve_entries(count, 0);
+            for(const auto& [k, v] : items) this->store_entry(k, &v, nullptr, 0, expiry);
+        }
+
+        if constexpr(SPLIT_VALUE) {
+            if(m_compactbudget) this->compact(m_compactbudget * count);
+        }
+    }
+
+    // Number of records written to the log with a single sync
+    void set_group_commit(size_t n) { m_groupcommit = std::max<size_t>(n, 1); }
+
+    // Log size past which commit() checkpoints: pages of the hash file written since the last checkpoint
+    // stay in private memory until then, a larger log writes each of them back less often
+    void set_checkpoint_size(size_t bytes) { m_checkpointsize = bytes; }
+
+    // Writes and syncs the pending batch, then applies it to the main files
+    void commit() {
+        static_assert(WAL, "commit() requires hashdb_flags_wal");
+        if(m_walbuffer.empty()) return;
+
+        impl::pwrite(m_fwal, m_walbuffer.data(), m_walbuffer.size(), m_walsize);
+        impl::sync(m_fwal);
+        m_walsize += m_walbuffer.size();
+        m_walbuffer.clear();
+        m_wrecords = 0;
+
+        // Applying in any order is fine: only the last state of each key is pending
+        const unsigned char op = m_walop;
+        m_walop = 0;
+
+        if(op == OP_CLEAR) this->clear_entries();
+        this->reserve_entries(m_pending.size(), 0);
+
+        for(const auto& [k, v] : m_pending) {
+            if(!v) this->erase_entry(k);
+            else if constexpr(CACHE) this->set_entry(k, *v, m_pendingexpiry[k]);
+            else this->set_entry(k, *v);
+        }
+
+        m_pending.clear();
+        m_pendingexpiry.clear();
+        if(m_walsize > m_checkpointsize) this->checkpoint();
+    }
+
+    // Commits, syncs the value file, writes the dirty pages of the hash file back and truncates the log
+    void checkpoint() {
+        static_assert(WAL, "checkpoint() requires hashdb_flags_wal");
+        this->commit();
+
+        if constexpr(SPLIT_VALUE) {
+            impl::msync(m_value, m_hash->valuecapacity);
+            impl::sync(m_fvalue);
+        }
+
+        if constexpr(STRING_KEY) {
+            impl::msync(m_key, m_hash->keycapacity);
+            impl::sync(m_fkey);
+        }
+
+        if(m_hashdirty) this->write_back_hash();
+
+        if constexpr(SPLIT_VALUE) {
+            // The hash file on disk no longer points into the drained region
+            if(m_compaction.phase == COMPACT_RECLAIM) {
+                writer_guard g{this};
+                this->reclaim_region();
+                m_hashdirty = true;
+            }
+        }
+
+        impl::resize(m_fwal, 0);
+        impl::sync(m_fwal);
+        m_walsize = 0;
+    }
+
+    bool get(const K& k, V& v) const {
+        latency_timer t{this, LATENCY_GET};
+        return this->get_hashed(this->hash(k), k, v);
+    }
+
+    std::optional<V> get(const K& k) const {
+        V v;
+        if(this->get(k, v)) return v;
+        return std::nullopt;
+    }
+
+    // Looks up every key of a contiguous range (std::vector, std::array, std::span...)
+    template<typename Keys, typename Function>
+    void multi_get(const Keys& keys, Function f) const { this->multi_get(std::data(keys), std::size(keys), f); }
+
+    // Calls f(key, std::optional<V>) for each key, in order.
+    // Lookups are pipelined: the slots (and values) of the next keys are prefetched while the current one resolves.
+    template<typename Function>
+    void multi_get(const K* keys, size_t n, Function f) const {
+        this->pipeline(keys, n, [&](size_t h, const K& k) {
+            V v;
+            if(this->get_hashed(h, k, v)) f(k, std::optional<V>{std::move(v)});
+            else f(k, std::optional<V>{});
+        });
+    }
+
+    // Calls f(key, std::optional<V>) once the value of 'k' is read, see set_io_depth().
+    // Values read from the value file complete in wait_async(), poll_async() or a later get_async() that finds
+    // the queue full, the others (misses, inline values, pending writes) complete at once.
+    // Writes must not run while reads are pending: they may move the extents being read.
+    template<typename Function>
+    void get_async(const K& k, Function f) const {
+        static_assert(!CONCURRENT, "get_async() is not available with hashdb_flags_concurrent");
+
+        if constexpr(SPLIT_VALUE) {
+            if(m_iodepth && this->queue_read(k, f)) return;
+        }
+
+        V v;
+        if(this->get(k, v)) f(k, std::optional<V>{std::move(v)});
+        else f(k, std::optional<V>{});
+    }
+
+    // Submits the queued reads and completes the finished ones without blocking, returns how many completed
+    size_t poll_async() const { return m_inflight ? this->complete_reads(0) : 0; }
+
+    // Completes every pending get_async()
+    void wait_async() const {
+        while(m_inflight) this->complete_reads(1);
+    }
+
+    size_t pending_async() const { return m_inflight; }
+
+    // get_async() reads the value file through io_uring with up to 'depth' reads in flight, 0 reads through the mapping.
+    // Reads are queued and handed to the kernel in batches, a single syscall for up to 'depth' of them.
+    // Where io_uring is not available they fall back to pread(), completing before get_async() returns.
+    void set_io_depth(size_t depth) {
+        static_assert(SPLIT_VALUE, "set_io_depth() requires split values");
+        static_assert(!CONCURRENT, "set_io_depth() is not available with hashdb_flags_concurrent");
+        this->wait_async();
+        m_ring.close();
+        m_iodepth = depth;
+        if(depth && m_ring.setup(static_cast<unsigned>(depth))) m_iodepth = std::min<size_t>(depth, m_ring.capacity());
+    }
+
+    // Returns a view straight into the value mapping (or the slot for inline values), invalidated by the next write.
+    // std::string values are returned without their size prefix, other types as raw serialized bytes.
+    // Compressed values are unpacked into a per thread buffer, the next get_view() invalidates it too.
+    std::optional<std::string_view> get_view(const K& k) const {
+        static_assert(SPLIT_VALUE, "get_view() requires split values");
+        this->commit_pending();
+
+        size_t h = this->hash(k);
+        if(!m_hash->size || this->bloom_rejects(h)) return std::nullopt;
+        slot_ref s = this->get_entry(h, k);
+        if(!this->hit(m_hash, s)) return std::nullopt;
+
+        const split_value& sv = s.kv->value;
+        thread_local std::string buffer;
+        std::string_view bytes = this->value_bytes(sv, buffer);
+
+        if constexpr(std::is_same_v<V, std::string> && std::is_same_v<Serializer, impl::Serializer>) {
+            std::string::size_type size;
+            std::copy_n(bytes.data(), sizeof(size), reinterpret_cast<char*>(&size));
+            return std::string_view{bytes.data() + sizeof(size), size};
+        }
+        else
+            return bytes;
+    }
+
+    // Returns the value of 'k' without copying it, 'missing' if there is none. Values from the value file go
+    // through the cache (see set_cache()), trivially copyable ones are read from the slot.
+    // The reference stays valid until the next write (or commit in WAL mode), or until a later get_cached()
+    // evicts it. Split values that bypass the cache (inline, too large, no budget) last until the next get_cached().
+    const V& get_cached(const K& k, const V& missing) const {
+        static_assert(!CONCURRENT, "get_cached() is not available with hashdb_flags_concurrent");
+
+        if constexpr(WAL) {
+            auto it = m_pending.find(k);
+            if(it != m_pending.end()) return it->second ? *it->second : missing;
+        }
+
+        size_t h = this->hash(k);
+        if(!m_hash->size || this->bloom_rejects(h)) return missing;
+        slot_ref s = this->get_entry(h, k);
+        if(!this->hit(m_hash, s)) return missing;
+
+        if constexpr(SPLIT_VALUE) {
+            if(m_cachebudget && s.kv->value.spilled()) return this->cached_value(s);
+
+            // Reusing the same V keeps its allocation
+            this->get_value(*s.kv, m_uncached);
+            return m_uncached;
+        }
+        else
+            return this->checked_value(*s.kv);
+    }
+
+    // Keeps up to 'bytes' of values deserialized from the value file in memory for get_cached(), evicted with CLOCK.
+    // Writing a slot drops its value, splits drop them all. 0 disables it.
+    void set_cache(size_t bytes) {
+        static_assert(SPLIT_VALUE, "set_cache() requires split values");
+        static_assert(!CONCURRENT, "set_cache() is not available with hashdb_flags_concurrent");
+        this->clear_cache();
+        m_cachebudget = bytes;
+    }
+
+    // Switches the access profile of the mappings, e.g. to hashdb_access_sequential around a scan
+    void set_access(size_t access) {
+        m_access = access;
+        this->apply_access();
+    }
+
+    // Faults in every page of the table from 'threads' workers (0: one per core), on the writer thread.
+    // Meant for restarts: lookups do not wait on the disk once it returns. Returns the bytes paged in.
+    size_t warmup(size_t threads = 0) const {
+        std::vector<std::pair<const char*, size_t>> chunks;
+
+        auto add = [&](const void* m, size_t size) {
+            for(size_t o = 0; o < size; o += WARMUP_CHUNK)
+                chunks.emplace_back(static_cast<const char*>(m) + o, std::min(WARMUP_CHUNK, size - o));
+        };
+
+        add(m_hash, sizeof(hash_header) + (m_hash->segments * SEGMENT_SIZE));
+        add(Self::get_directory(m_hash, m_hash->segmentcapacity), (size_t{1} << m_hash->globaldepth) * sizeof(uint32_t));
+        if(m_value) add(m_value, m_hash->valuesize);
+        if(m_key) add(m_key, m_hash->keysize);
+        if(m_bloom) add(m_bloom, Self::bloom_size(m_bloom->blocks));
+
+        if(!threads) threads = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+        threads = std::max<size_t>(std::min(threads, chunks.size()), 1);
+        size_t next = 0, bytes = 0;
+
+        impl::parallel(threads, [&](size_t) {
+            for(size_t c = impl::atomic_add(next, size_t{1}) - 1; c < chunks.size(); c = impl::atomic_add(next, size_t{1}) - 1) {
+                impl::prefault(chunks[c].first, chunks[c].second);
+                impl::atomic_add(bytes, chunks[c].second);
+            }
+        });
+
+        return bytes;
+    }
+
+    void collect_garbage() { this->rewrite_files(nullptr); }
+
+    // Trains the dictionary from about 'samplebytes' of values spread over the table, then rewrites the value file
+    // like collect_garbage() does, repacking every value with it
+    void train_dictionary(size_t samplebytes = DICTIONARY_SAMPLE) {
+        static_assert(COMPRESS, "train_dictionary() requires hashdb_flags_compress");
+        if constexpr(WAL) this->checkpoint();
+
+        std::string dict = impl::lz_train(this->sample_values(samplebytes), DICTIONARY_SIZE);
+        this->rewrite_files(&dict);
+    }
+
+    // Checks every committed value against its checksum from 'threads' workers (0: one per core),
+    // returns the keys whose value is corrupted or points outside the value file.
+    // Unserialized values are checked in their slots. Split values: slots are scanned first and spilled values bucketed
+    // by region, then workers claim regions in file order: each one is read ahead as a whole and walked in offset order,
+    // so the value file streams in sequentially.
+    std::vector<K> verify(size_t threads = 0) const {
+        static_assert(CHECKSUM, "verify() requires hashdb_flags_checksum");
+
+        threads = this->scan_threads(threads);
+        const size_t segments = m_hash->segments;
+        std::vector<std::vector<K>> corrupted(threads);
+
+        // Each worker always takes the same segments: the bucket offsets of the first pass hold for the second one
+        auto for_each_slot = [&](size_t t, auto f) {
+            for(size_t seg = segments * t / threads; seg < segments * (t + 1) / threads; ++seg) {
+                const unsigned char* ctrl = Self::get_control(m_hash, seg);
+                const kv_pair* e = Self::get_slots(m_hash, seg);
+
+                for(size_t i = 0; i < SEGMENT_SLOTS; ++i) {
+                    if(ctrl[i] & CTRL_FULL) f(e[i]);
+                }
+            }
+        };
+
+        if constexpr(!SPLIT_VALUE) {
+            impl::parallel(threads, [&](size_t t) {
+                for_each_slot(t, [&](const kv_pair& e) {
+                    if(Self::slot_checksum(e) != e.checksum) corrupted[t].push_back(this->load_key(e.key));
+                });
+            });
+        }
+        else {
+            const size_t capacity = m_hash->valuecapacity, bits = m_hash->regionbits;
+            const size_t regions = ((capacity - 1) >> bits) + 1;
+            std::vector<size_t> counts(threads * regions), start(regions + 1);
+            std::vector<const kv_pair*> extents;
+
+            auto in_file = [&](const split_value& sv) { return sv.extent.capacity <= capacity && sv.extent.offset <= capacity - sv.extent.capacity; };
+
+            impl::parallel(threads, [&](size_t t) {
+                for_each_slot(t, [&](const kv_pair& e) {
+                    const split_value& sv = e.value;
+
+                    if(sv.spilled() && in_file(sv))
+                        ++counts[(t * regions) + (sv.extent.offset >> bits)];
+                    else if(sv.spilled() || sv.size > INLINE_VALUE || this->stored_checksum(sv, m_value) != sv.checksum)
+                        corrupted[t].push_back(this->load_key(e.key));
+                });
+            });
+
+            size_t position = 0;
+
+            for(size_t r = 0; r < regions; ++r) {
+                start[r] = position;
+
+                for(size_t t = 0; t < threads; ++t) {
+                    size_t count = counts[(t * regions) + r];
+                    counts[(t * regions) + r] = position;
+                    position += count;
+                }
+            }
+
+            start[regions] = position;
+            extents.resize(position);
+
+            impl::parallel(threads, [&](size_t t) {
+                for_each_slot(t, [&](const kv_pair& e) {
+                    if(e.value.spilled() && in_file(e.value)) extents[counts[(t * regions) + (e.value.extent.offset >> bits)]++] = &e;
+                });
+            });
+
+            size_t next = 0;
+
+            impl::parallel(threads, [&](size_t t) {
+                for(size_t r = impl::atomic_add(next, size_t{1}) - 1; r < regions; r = impl::atomic_add(next, size_t{1}) - 1) {
+                    if(start[r] == start[r + 1]) continue;
+
+                    auto first = extents.begin() + static_cast<std::ptrdiff_t>(start[r]), last = extents.begin() + static_cast<std::ptrdiff_t>(start[r + 1]);
+                    std::sort(first, last, [](const kv_pair* a, const kv_pair* b) { return a->value.extent.offset < b->value.extent.offset; });
+
+                    size_t base = r << bits;
+                    impl::will_need(m_value + base, std::min(size_t{1} << bits, capacity - base));
+
+                    for( ; first != last; ++first) {
+                        if(this->stored_checksum((*first)->value, m_value) != (*first)->value.checksum)
+                            corrupted[t].push_back(this->load_key((*first)->key));
+                    }
+                }
+            });
+        }
+
+        std::vector<K> res = std::move(corrupted[0]);
+        for(size_t t = 1; t < threads; ++t) res.insert(res.end(), corrupted[t].begin(), corrupted[t].end());
+        return res;
+    }
+
+    // Health of the table, with the same guarantees as iterators. The slots are scanned for the probe histogram.
+    hashdb_stats stats() const {
+        this->commit_pending();
+        hashdb_stats s;
+        s.size = m_hash->size;
+        s.capacity = m_hash->capacity;
+        s.fill = m_hash->fill;
+        s.tombstones = m_hash->fill - m_hash->size;
+        s.segments = m_hash->segments;
+        s.globaldepth = m_hash->globaldepth;
+
+        for(size_t seg = 0; seg < m_hash->segments; ++seg) {
+            const unsigned char* ctrl = Self::get_control(m_hash, seg);
+            const kv_pair* e = Self::get_slots(m_hash, seg);
+
+            for(size_t i = 0; i < SEGMENT_SLOTS; ++i) {
+                if(!(ctrl[i] & CTRL_FULL)) continue;
+
+                size_t home = Self::home_group(e[i].hash, Self::get_segment(m_hash, seg)->depth);
+                size_t d = ((i - home) & (SEGMENT_SLOTS - 1)) / impl::GROUP_SIZE;
+                if(d >= s.probes.size()) s.probes.resize(d + 1);
+                ++s.probes[d];
+            }
+        }
+
+        if constexpr(SPLIT_VALUE) {
+            const size_t regions = ((m_hash->valuecapacity - 1) >> m_hash->regionbits) + 1;
+            s.valuecapacity = m_hash->valuecapacity;
+            s.valuereclaimed = m_hash->arenaend - m_hash->arenaoffset;
+
+            for(size_t i = 0; i < std::min(regions, VALUE_REGIONS); ++i) {
+                if(m_hash->regionlive[i] == REGION_RECLAIMED) s.valuereclaimed += size_t{1} << m_hash->regionbits;
+                else s.valuelive += m_hash->regionlive[i];
+            }
+
+            s.valuedead = m_hash->valuesize - s.valuelive - s.valuereclaimed;
+            s.valuefree = m_hash->valuefree - (m_hash->arenaend - m_hash->arenaoffset);
+        }
+
+        if constexpr(STRING_KEY) {
+            s.keycapacity = m_hash->keycapacity;
+            s.keylive = m_hash->keysize - m_hash->keyfree;
+            s.keydead = m_hash->keyfree;
+        }
+
+        s.splits = m_events[EVENT_SPLIT];
+        s.purges = m_events[EVENT_PURGE];
+        s.rehashes = m_events[EVENT_REHASH];
+        s.collections = m_events[EVENT_COLLECT];
+        s.compactions = m_events[EVENT_COMPACT];
+        s.extendhash = m_events[EVENT_EXTEND_HASH];
+        s.extendvalue = m_events[EVENT_EXTEND_VALUE];
+        s.extendkey = m_events[EVENT_EXTEND_KEY];
+
+        if constexpr(LATENCY) {
+            hashdb_latency* latencies[LATENCIES] = {&s.get, &s.contains, &s.set, &s.erase};
+
+            for(size_t op = 0; op < LATENCIES; ++op) {
+                const latency_counter& c = m_latency[op];
+                hashdb_latency& l = *latencies[op];
+                l.count = impl::atomic_load_relaxed(c.count);
+                l.time = std::chrono::nanoseconds{static_cast<int64_t>(impl::atomic_load_relaxed(c.time))};
+
+                for(size_t b = 0; b < hashdb_latency::BUCKETS; ++b)
+                    l.buckets[b] = impl::atomic_load_relaxed(c.buckets[b]);
+            }
+        }
+
+        return s;
+    }
+
+    // Starts the operation counters and latency histograms over
+    void reset_stats() {
+        m_events = {};
+        m_latency = {};
+    }
+
+    // Writes every committed entry to 'path' in the immutable format read by FrozenHashDB
+    void freeze(const std::string& path) {
+        if constexpr(WAL) this->commit();
+
+        const uint64_t now = CACHE ? Self::now() : 0;
+        std::vector<uint64_t> hashes;
+        hashes.reserve(m_hash->size);
+        this->for_each_entry([&](const kv_pair& e) { if(!Self::expired(e, now)) hashes.push_back(e.hash); });
+
+        FrozenHashDB<K, V, Serializer, Hasher>::write(path, hashes, [&](auto f) {
+            V v;
+
+            this->for_each_entry([&](const kv_pair& e) {
+                if(Self::expired(e, now)) return;
+                this->get_value(e, v);
+                f(this->load_key(e.key), v);
+            });
+        });
+    }
+
+    // Doubles the capacity by splitting every segment in place
+    void rehash() {
+        assume(m_hash);
+
+        event_timer t{this, EVENT_REHASH};
+        writer_guard g{this};
+        std::vector<size_t> patterns(m_hash->segments, MAX_SEGMENTS);
+
+        const uint32_t* directory = Self::get_directory(m_hash, m_hash->segmentcapacity);
+
+        for(size_t i = 0; i < (size_t{1} << m_hash->globaldepth); ++i) {
+            size_t seg = directory[i];
+            if(patterns[seg] == MAX_SEGMENTS) patterns[seg] = i;
+        }
+
+        for(size_t seg = 0; seg < patterns.size(); ++seg) {
+            if(Self::get_segment(m_hash, seg)->depth < MAX_DEPTH)
+                this->split_segment(seg, patterns[seg]);
+        }
+
+        if constexpr(BLOOM) this->rebuild_bloom();
+    }
+
+    // Bytes compact() may move after each set() and erase(), 0 leaves it to explicit calls
+    void set_compaction(size_t budget) {
+        static_assert(SPLIT_VALUE, "set_compaction() requires split values");
+        m_compactbudget = budget;
+    }
+
+    // One bounded step draining the most fragmented region of the value file: about 'budget' bytes
+    // are moved or scanned. Runs on the writer thread, returns false when nothing is left to drain.
+    bool compact(size_t budget) {
+        static_assert(SPLIT_VALUE, "compact() requires split values");
+        if(m_compaction.phase == COMPACT_RECLAIM) return false;
+        if(m_compaction.phase == COMPACT_IDLE && !this->begin_compaction()) return false;
+
+        if constexpr(WAL) {
+            // A non empty log makes replay() drop free lists whose links these moves may overwrite
+            if(!m_walsize) {
+                this->log_record(OP_COMPACT);
+                this->commit();
+            }
+        }
+
+        event_timer t{this, EVENT_COMPACT};
+        writer_guard g{this};
+        m_hashdirty = true;
+
+        while(budget && m_compaction.phase == COMPACT_PURGE)
+            budget -= std::min(budget, this->purge_step());
+
+        while(budget && m_compaction.phase == COMPACT_EVACUATE)
+            budget -= std::min(budget, this->evacuate_step());
+
+        return true;
+    }
+
+    static Self load(const std::string& name, std::string basepath = std::string{}, size_t access = hashdb_access_default) {
+        assume(!name.empty());
+        if(!basepath.empty()) basepath.append(impl::PATH_SEPARATOR);
+
+        std::string hashpath = basepath + name + impl::HASH_SUFFIX;
+        if constexpr(WAL) {
+            Self::recover_checkpoint(hashpath);
+            Self::recover_files(hashpath, basepath + name, basepath + name + impl::WAL_SUFFIX);
+        }
+        if(!impl::is_file(hashpath)) except("Hash file '{}' not found", hashpath);
+        return Self{impl::open(hashpath), name, basepath, access};
+    }
+
+    // Creates a table from a random access range of (key, value) pairs in a single pass: the directory is sized
+    // once from the record count, records are bucketed by segment and 'threads' workers fill disjoint segments
+    // (and their value/key file ranges). Later duplicates win. 0 threads uses every core.
+    template<typename Items>
+    static Self build(const std::string& name, const Items& items, size_t threads = 0, std::string basepath = std::string{}) {
+        return Self{name, basepath, items, threads};
+    }
+
+private:
+    template<typename Items>
+    HashDB(const std::string& name, std::string basepath, const Items& items, size_t threads) {
+        this->open(name, basepath);
+        this->bulk_load(items, threads ? threads : std::max<unsigned>(std::thread::hardware_concurrency(), 1));
+    }
+
+    HashDB(impl::file_h fhash, [[maybe_unused]] const std::string& name, [[maybe_unused]] const std::string basepath, size_t access): m_fhash{fhash}, m_access{access} {
+        assume(m_fhash != impl::INVALID_HANDLE);
+        m_fhashpath = basepath + name + impl::HASH_SUFFIX;
+
+        const bool populate = access & hashdb_access_populate;
+        size_t size = impl::size(fhash);
+        if(size < sizeof(hash_header)) except("Invalid hash file");
+        m_hash = impl::mmap<hash_header>(m_fhash, size, WAL, populate);
+        assume(m_hash);
+
+        if(m_hash->integersize != sizeof(size_t)) except("Unexpected integer size");
+        if(m_hash->signature != SIGNATURE) except("Invalid signature");
+        if(m_hash->version != VERSION) except("Unsupported version {}", m_hash->version);
+
+        if constexpr(WAL) {
+            // Segments appended after the last checkpoint grew the file past what its header describes
+            size_t expected = Self::hash_size(m_hash->segmentcapacity);
+
+            if(size > expected) {
+                impl::munmap(m_hash, size);
+                impl::resize(m_fhash, expected);
+                m_hash = impl::mmap<hash_header>(m_fhash, expected, WAL, populate);
+                assume(m_hash);
+                size = expected;
+            }
+        }
+
+        if(size != Self::hash_size(m_hash->segmentcapacity)) except("Invalid hash file size");
+
+        // A checkpoint taken inside a write (collect_garbage()) saves an odd sequence
+        m_hash->sequence = 0;
+
+        if constexpr(SPLIT_VALUE) {
+            m_fvaluepath = basepath + name + impl::VALUE_SUFFIX;
+            if(!impl::is_file(m_fvaluepath)) except("Value file '{}' not found", m_fvaluepath);
+            m_fvalue = impl::open(m_fvaluepath);
+            assume(m_fvalue != impl::INVALID_HANDLE);
+            m_value = impl::mmap<char>(m_fvalue, m_hash->valuecapacity, false, populate);
+            assume(m_value);
+            m_reclaimed = this->count_reclaimed();
+        }
+
+        if constexpr(COMPRESS) m_dictindex = impl::lz_index(this->dictionary(m_hash));
+
+        if constexpr(STRING_KEY) {
+            m_fkeypath = basepath + name + impl::KEY_SUFFIX;
+            if(!impl::is_file(m_fkeypath)) except("Key file '{}' not found", m_fkeypath);
+            m_fkey = impl::open(m_fkeypath);
+            assume(m_fkey != impl::INVALID_HANDLE);
+            m_key = impl::mmap<char>(m_fkey, m_hash->keycapacity, false, populate);
+            assume(m_key);
+        }
+
+        if constexpr(BLOOM) {
+            m_fbloompath = basepath + name + impl::BLOOM_SUFFIX;
+            this->load_bloom();
+        }
+
+        if constexpr(CACHE) this->init_cache_mode();
+
+        if constexpr(WAL) {
+            m_fwalpath = basepath + name + impl::WAL_SUFFIX;
+            m_fwal = impl::open(m_fwalpath);
+            assume(m_fwal != impl::INVALID_HANDLE);
+            m_walsize = impl::size(m_fwal);
+            this->replay();
+        }
+
+        this->apply_access();
+    }
+
+    // Copies the live extents of the value and key files to new files, packing values with 'dict' and installing it if given
+    void rewrite_files([[maybe_unused]] const std::string* dict) {
+        event_timer t{this, EVENT_COLLECT};
+        if constexpr(WAL) this->checkpoint();
+
+        if constexpr(BLOOM) {
+            writer_guard g{this};
+            this->rebuild_bloom();
+        }
+
+        if(this->empty()) {
+            if constexpr(COMPRESS) {
+                writer_guard g{this};
+                if(dict) this->install_dictionary(*dict);
+            }
+
+            return;
+        }
+
+        if constexpr(SPLIT_VALUE || STRING_KEY) {
+            writer_guard g{this};
+            std::string tmpvalue = m_fvaluepath + impl::TMP_SUFFIX, tmpkey = m_fkeypath + impl::TMP_SUFFIX;
+            impl::file_h newvaluefile = impl::INVALID_HANDLE, newkeyfile = impl::INVALID_HANDLE;
+            size_t valueoffset = 0, keyoffset = 0;
+            [[maybe_unused]] std::string_view olddict = this->dictionary(m_hash);
+            [[maybe_unused]] std::vector<uint32_t> newindex;
+            [[maybe_unused]] std::string buffer;
+
+            if constexpr(COMPRESS) {
+                if(dict) {
+                    // Repacked values never outgrow their raw size plus the frame, make room for that first
+                    size_t bound = 0;
+                    newindex = impl::lz_index(*dict);
+
+                    this->for_each_entry([&](const kv_pair& e) {
+                        impl::lz_frame f;
+                        if(!e.value.spilled()) return;
+                        std::memcpy(&f, m_value + e.value.extent.offset, sizeof(f));
+                        bound += Self::class_size(Self::value_class(sizeof(f) + f.rawsize));
+                    });
+
+                    while(bound > m_hash->valuecapacity) this->extend_value();
+                }
+            }
+
+            if constexpr(SPLIT_VALUE) {
+                newvaluefile = impl::open(tmpvalue);
+                assume(newvaluefile != impl::INVALID_HANDLE);
+                impl::resize(newvaluefile, m_hash->valuecapacity);
+                m_compaction = {};
+                m_reclaimed = 0;
+                std::fill_n(m_hash->regionlive, VALUE_REGIONS, 0);
+            }
+
+            if constexpr(STRING_KEY) {
+                newkeyfile = impl::open(tmpkey);
+                assume(newkeyfile != impl::INVALID_HANDLE);
+                impl::resize(newkeyfile, m_hash->keycapacity);
+            }
+
+            for(size_t seg = 0; seg < m_hash->segments; ++seg) {
+                const unsigned char* ctrl = Self::get_control(m_hash, seg);
+                kv_pair* e = Self::get_slots(m_hash, seg);
+
+                for(size_t i = 0; i < SEGMENT_SLOTS; ++i, ++e) {
+                    if(!(ctrl[i] & CTRL_FULL)) continue;
+
+                    if constexpr(SPLIT_VALUE) {
+                        if(e->value.spilled()) {
+                            hash_offset_value& ov = e->value.extent;
+                            const char* p = m_value + ov.offset;
+                            size_t n = ov.capacity;
+
+                            if constexpr(COMPRESS) {
+                                if(dict) {
+                                    if(!impl::lz_unpack(p, n, buffer, olddict)) except("Corrupted value at offset {}", ov.offset);
+                                    impl::lz_pack(buffer.data(), buffer.size(), m_pbuffer, *dict, newindex.data());
+                                    p = m_pbuffer.data();
+                                    n = m_pbuffer.size();
+                                    ov.capacity = Self::class_size(Self::value_class(n));
+                                    if constexpr(CHECKSUM) e->value.checksum = impl::crc32c(p, n);
+                                }
+                            }
+
+                            impl::pwrite(newvaluefile, p, n, valueoffset);
+                            ov.offset = valueoffset;
+                            valueoffset += ov.capacity;
+                            this->account_value(ov, true);
+                        }
+                    }
+
+                    if constexpr(STRING_KEY) {
+                        if(e->key.size <= KEY_PREFIX) continue;
+                        impl::pwrite(newkeyfile, m_key + e->key.offset, e->key.size - KEY_PREFIX, keyoffset);
+                        e->key.offset = keyoffset;
+                        keyoffset += Self::key_extent(e->key).capacity;
+                    }
+                }
+            }
+
+            if constexpr(SPLIT_VALUE) {
+                m_hash->valuesize = valueoffset;
+                m_hash->valuefree = m_hash->arenaoffset = m_hash->arenaend = 0;
+                std::fill_n(m_hash->freelist, VALUE_CLASSES, 0);
+            }
+
+            if constexpr(STRING_KEY) {
+                m_hash->keysize = keyoffset;
+                m_hash->keyfree = 0;
+                std::fill_n(m_hash->keylist, VALUE_CLASSES, 0);
+            }
+
+            if constexpr(COMPRESS) {
+                if(dict) this->install_dictionary(*dict);
+            }
+
+            if constexpr(WAL) {
+                // The private hash mapping holds the new offsets: write it aside and commit the renames
+                std::string tmphash = m_fhashpath + impl::TMP_SUFFIX;
+                impl::file_h newhashfile = this->write_hashfile(tmphash);
+                if constexpr(SPLIT_VALUE) impl::sync(newvaluefile);
+                if constexpr(STRING_KEY) impl::sync(newkeyfile);
+                this->log_record(OP_GC);
+                this->commit();
+
+                impl::rename(tmphash, m_fhashpath);
+                this->replace_hashfile(newhashfile);
+            }
+
+            if constexpr(SPLIT_VALUE) this->replace_file(tmpvalue, m_fvaluepath, newvaluefile, m_fvalue, m_value, m_hash->valuecapacity);
+            if constexpr(STRING_KEY) this->replace_file(tmpkey, m_fkeypath, newkeyfile, m_fkey, m_key, m_hash->keycapacity);
+            if constexpr(WAL) this->checkpoint();
+        }
+    }
+
+    void install_dictionary(std::string_view dict) {
+        assume(dict.size() <= DICTIONARY_SIZE);
+        std::copy_n(dict.data(), dict.size(), m_hash->dictionary);
+        m_hash->dictsize = dict.size();
+        m_dictindex = impl::lz_index(dict);
+        m_hashdirty = true;
+    }
+
+    // About 'bytes' of serialized values, picked at an even stride over the spilled ones
+    std::string sample_values(size_t bytes) const {
+        std::string samples, buffer;
+        const size_t stride = std::max<size_t>((m_hash->valuesize - m_hash->valuefree) / std::max<size_t>(bytes, 1), 1);
+        size_t i = 0;
+
+        this->for_each_entry([&](const kv_pair& e) {
+            if(samples.size() >= bytes || !e.value.spilled() || (i++ % stride)) return;
+            samples.append(this->value_bytes(e.value, buffer));
+        });
+
+        return samples;
+    }
+
+    template<typename Items>
+    void bulk_load(const Items& items, size_t threads) {
+        const size_t n = std::size(items);
+        const auto first = std::begin(items);
+        threads = std::max<size_t>(std::min(threads, n / 4096), 1);
+        const uint64_t expiry = this->default_expiry();
+
+        auto chunk = [&](size_t t) { return std::make_pair(n * t / threads, n * (t + 1) / threads); };
+        auto measure = [](const V& v) {
+            size_t size = 0;
+            Serializer::serialize(v, [&](const void*, size_t s) { size += s; });
+            return size;
+        };
+
+        std::vector<uint64_t> hashes(n);
+        [[maybe_unused]] std::vector<std::string> packed(FRAMED ? n : 0);
+
+        if constexpr(COMPRESS) {
+            // The dictionary is trained from records picked at an even stride over the input
+            std::string samples, buffer;
+
+            for(size_t i = 0, stride = std::max<size_t>(n / 4096, 1); i < n && samples.size() < DICTIONARY_SAMPLE; i += stride) {
+                buffer.clear();
+                Self::serialize_value(std::get<1>(*(first + i)), buffer);
+                if(buffer.size() > INLINE_VALUE) samples += buffer;
+            }
+
+            this->install_dictionary(impl::lz_train(samples, DICTIONARY_SIZE));
+        }
+
+        impl::parallel(threads, [&](size_t t) {
+            auto [b, e] = chunk(t);
+            [[maybe_unused]] std::string buffer;
+
+            for(size_t i = b; i < e; ++i) {
+                hashes[i] = this->hash(std::get<0>(*(first + i)));
+
+                if constexpr(FRAMED) {
+                    buffer.clear();
+                    Self::serialize_value(std::get<1>(*(first + i)), buffer);
+                    if(buffer.size() > INLINE_VALUE) this->pack_value(buffer.data(), buffer.size(), packed[i]);
+                }
+            }
+        });
+
+        // Every segment gets the same depth: deepen until none of them would need a split
+        size_t depth = 0;
+        while(depth < MAX_DEPTH && (SEGMENT_FILL << depth) * 0.85 < n) ++depth;
+
+        struct histogram { size_t count, valuebytes, keybytes; };
+        std::vector<histogram> histograms;
+        size_t segments;
+
+        for(;;) {
+            segments = size_t{1} << depth;
+            histograms.assign(threads * segments, {0, 0, 0});
+
+            impl::parallel(threads, [&](size_t t) {
+                auto [b, e] = chunk(t);
+
+                for(size_t i = b; i < e; ++i) {
+                    histogram& hg = histograms[(t * segments) + (hashes[i] & (segments - 1))];
+                    ++hg.count;
+
+                    if constexpr(FRAMED) {
+                        if(!packed[i].empty()) hg.valuebytes += Self::class_size(Self::value_class(packed[i].size()));
+                    }
+                    else if constexpr(SPLIT_VALUE) {
+                        size_t size = measure(std::get<1>(*(first + i)));
+                        if(size > INLINE_VALUE) hg.valuebytes += Self::class_size(Self::value_class(size));
+                    }
+
+                    if constexpr(STRING_KEY) {
+                        size_t size = std::get<0>(*(first + i)).size();
+                        if(size > KEY_PREFIX) hg.keybytes += Self::class_size(Self::value_class(size - KEY_PREFIX));
+                    }
+                }
+            });
+
+            size_t maxcount = 0;
+
+            for(size_t seg = 0; seg < segments; ++seg) {
+                size_t count = 0;
+                for(size_t t = 0; t < threads; ++t) count += histograms[(t * segments) + seg].count;
+                maxcount = std::max(maxcount, count);
+            }
+
+            if(maxcount <= SEGMENT_FILL) break;
+            if(depth < MAX_DEPTH) ++depth;
+            else if(maxcount < SEGMENT_SLOTS) break;
+            else except("Too many records for a HashDB ({})", n);
+        }
+
+        // Per (thread, segment) offsets: records are scattered by segment, keeping their order
+        std::vector<size_t> order(n), start(segments + 1), valuestart(segments), keystart(segments);
+        size_t valuebytes = 0, keybytes = 0, position = 0;
+
+        for(size_t seg = 0; seg < segments; ++seg) {
+            start[seg] = position;
+            valuestart[seg] = valuebytes;
+            keystart[seg] = keybytes;
+
+            for(size_t t = 0; t < threads; ++t) {
+                histogram& hg = histograms[(t * segments) + seg];
+                size_t count = hg.count;
+                hg.count = position;
+                position += count;
+                valuebytes += hg.valuebytes;
+                keybytes += hg.keybytes;
+            }
+        }
+
+        start[segments] = n;
+
+        impl::parallel(threads, [&](size_t t) {
+            auto [b, e] = chunk(t);
+            for(size_t i = b; i < e; ++i) order[histograms[(t * segments) + (hashes[i] & (segments - 1))].count++] = i;
+        });
+
+        // Files are grown once, the header fields describing the content are written last
+        while(m_hash->segmentcapacity < segments) this->extend_hash();
+
+        if constexpr(SPLIT_VALUE) {
+            while(static_cast<float>(valuebytes) > static_cast<float>(m_hash->valuecapacity) * MAX_FILL_CAPACITY)
+                this->extend_value();
+        }
+
+        if constexpr(STRING_KEY) {
+            while(keybytes > m_hash->keycapacity) this->extend_key();
+        }
+
+        m_hash->globaldepth = depth;
+
+        uint32_t* directory = Self::get_directory(m_hash, m_hash->segmentcapacity);
+
+        for(size_t seg = 0; seg < segments; ++seg) {
+            directory[seg] = static_cast<uint32_t>(seg);
+            Self::get_segment(m_hash, seg)->depth = static_cast<unsigned char>(depth);
+        }
+
+        // Extents of replaced duplicates, released once the workers are done
+        std::vector<std::vector<std::pair<hash_offset_value, bool>>> unused(threads);
+
+        impl::parallel(threads, [&](size_t t) {
+            for(size_t seg = segments * t / threads; seg < segments * (t + 1) / threads; ++seg) {
+                size_t valueoffset = valuestart[seg], keyoffset = keystart[seg];
+
+                for(size_t i = start[seg]; i < start[seg + 1]; ++i) {
+                    const auto& [k, v] = *(first + order[i]);
+                    const uint64_t h = hashes[order[i]];
+                    slot_ref s = this->find_entry(m_hash, m_hash->segmentcapacity, h, k);
+                    kv_pair& e = *s.kv;
+
+                    if constexpr(STRING_KEY) {
+                        if(k.size() > KEY_PREFIX) {
+                            hash_offset_value ov{Self::class_size(Self::value_class(k.size() - KEY_PREFIX)), keyoffset};
+                            keyoffset += ov.capacity;
+
+                            if(s.full())
+                                unused[t].emplace_back(ov, true);
+                            else {
+                                std::copy_n(k.data() + KEY_PREFIX, k.size() - KEY_PREFIX, m_key + ov.offset);
+                                e.key.offset = ov.offset;
+                            }
+                        }
+
+                        if(!s.full()) {
+                            e.key.size = static_cast<uint32_t>(k.size());
+                            std::fill_n(e.key.prefix, KEY_PREFIX, 0);
+                            std::copy_n(k.data(), std::min<size_t>(k.size(), KEY_PREFIX), e.key.prefix);
+                        }
+                    }
+                    else
+                        e.key = k;
+
+                    if constexpr(SPLIT_VALUE) {
+                        split_value& sv = e.value;
+                        if(s.full() && sv.spilled()) unused[t].emplace_back(sv.extent, false);
+
+                        std::string_view frame;
+                        if constexpr(FRAMED) frame = packed[order[i]];
+
+                        size_t size = frame.empty() ? measure(v) : frame.size();
+                        char* p;
+
+                        if(frame.empty() && size <= INLINE_VALUE) {
+                            sv.size = static_cast<unsigned char>(size);
+                            p = sv.data;
+                        }
+                        else {
+                            sv.extent = {Self::class_size(Self::value_class(size)), valueoffset};
+                            sv.size = SPILLED_VALUE;
+                            valueoffset += sv.extent.capacity;
+                            p = m_value + sv.extent.offset;
+                        }
+
+                        if(!frame.empty())
+                            std::copy_n(frame.data(), frame.size(), p);
+                        else {
+                            Serializer::serialize(v, [&](const void* data, size_t sz) {
+                                std::copy_n(reinterpret_cast<const char*>(data), sz, p);
+                                p += sz;
+                            });
+                        }
+
+                        if constexpr(CHECKSUM) sv.checksum = this->stored_checksum(sv, m_value);
+                    }
+                    else {
+                        e.value = v;
+                        if constexpr(CHECKSUM) e.checksum = Self::slot_checksum(e);
+                    }
+
+                    if constexpr(CACHE) e.expiry = expiry;
+
+                    if(!s.full()) {
+                        e.hash = h;
+                        *s.ctrl = Self::control_hash(h);
+                        ++Self::get_segment(m_hash, seg)->fill;
+                    }
+                }
+            }
+        });
+
+        m_hash->segments = segments;
+        m_hash->capacity = segments * SEGMENT_SLOTS;
+        m_hash->fill = 0;
+        for(size_t seg = 0; seg < segments; ++seg) m_hash->fill += Self::get_segment(m_hash, seg)->fill;
+        m_hash->size = m_hash->fill;
+        m_hashdirty = true;
+
+        if constexpr(CACHE) {
+            if(expiry) {
+                for(size_t seg = 0; seg < segments; ++seg) this->schedule(seg, expiry);
+            }
+        }
+
+        if constexpr(SPLIT_VALUE) {
+            m_hash->valuesize = valuebytes;
+            this->for_each_entry([&](const kv_pair& e) { if(e.value.spilled()) this->account_value(e.value.extent, true); });
+        }
+
+        if constexpr(STRING_KEY) m_hash->keysize = keybytes;
+
+        for(const auto& extents : unused) {
+            for(const auto& [ov, key] : extents) {
+                if(key) this->push_key(ov);
+                else if constexpr(SPLIT_VALUE) this->push_value(ov);
+            }
+        }
+
+        if constexpr(BLOOM) this->rebuild_bloom();
+        if constexpr(WAL) this->checkpoint();
+    }
+
+    void clear_entries() {
+        writer_guard g{this};
+
+        for(size_t seg = 0; seg < m_hash->segments; ++seg) {
+            std::fill_n(Self::get_control(m_hash, seg), SEGMENT_SLOTS, CTRL_EMPTY);
+            Self::get_segment(m_hash, seg)->fill = 0;
+        }
+
+        std::fill_n(m_hash->freelist, VALUE_CLASSES, 0);
+        std::fill_n(m_hash->regionlive, VALUE_REGIONS, 0);
+        m_reclaimed = 0;
+        std::fill_n(m_hash->keylist, VALUE_CLASSES, 0);
+        m_hash->fill = m_hash->size = m_hash->valuesize = m_hash->valuefree = 0;
+        m_hash->arenaoffset = m_hash->arenaend = m_hash->keysize = m_hash->keyfree = 0;
+        m_compaction = {};
+        m_hashdirty = true;
+        this->clear_cache();
+        if constexpr(BLOOM) this->rebuild_bloom();
+
+        if constexpr(CACHE) {
+            for(std::vector<uint64_t>& bucket : m_wheel) bucket.clear();
+            m_evicthand = 0;
+        }
+    }
+
+    void erase_entry(const K& k) {
+        writer_guard g{this};
+        size_t h = this->hash(k);
+        slot_ref s = this->get_entry(h, k);
+        if(s.full()) this->remove_slot(Self::get_segment_index(m_hash, h), s);
+    }
+
+    // Releases the value and key of the full slot 's' of 'seg', then empties it
+    void remove_slot(size_t seg, slot_ref s) {
+        this->uncache(s);
+        --m_hash->size;
+        m_hashdirty = true;
+        if constexpr(SPLIT_VALUE) {
+            if(s.kv->value.spilled()) this->free_value(s.kv->value.extent);
+        }
+        if constexpr(STRING_KEY) this->free_key(s.kv->key);
+
+        // A group with an empty slot never made a probe move past it: no tombstone is needed
+        const unsigned char* ctrl = Self::get_control(m_hash, seg);
+        size_t group = static_cast<size_t>(s.ctrl - ctrl) & ~(impl::GROUP_SIZE - 1);
+
+        if(impl::group_match(ctrl + group, CTRL_EMPTY)) {
+            *s.ctrl = CTRL_EMPTY;
+            --m_hash->fill;
+            --Self::get_segment(m_hash, seg)->fill;
+        }
+        else
+            *s.ctrl = CTRL_TOMBSTONE;
+    }
+
+    void put(const K& k, const V& v, uint64_t expiry) {
+        latency_timer t{this, LATENCY_SET};
+
+        if constexpr(WAL) {
+            m_pending[k] = v;
+            if constexpr(CACHE) m_pendingexpiry[k] = expiry;
+            this->log_record(OP_SET, &k, &v, expiry);
+            if(++m_wrecords >= m_groupcommit) this->commit();
+        }
+        else
+            this->set_entry(k, v, expiry);
+
+        if constexpr(SPLIT_VALUE) {
+            if(m_compactbudget) this->compact(m_compactbudget);
+        }
+
+        if constexpr(CACHE) this->expire(1);
+    }
+
+    void set_entry(const K& k, const V& v, uint64_t expiry = 0) {
+        if constexpr(SPLIT_VALUE) {
+            m_wbuffer.clear();
+            Self::serialize_value(v, m_wbuffer);
+            this->store_entry(k, nullptr, m_wbuffer.data(), m_wbuffer.size(), expiry);
+        }
+        else
+            this->store_entry(k, &v, nullptr, 0, expiry);
+    }
+
+    static void serialize_value(const V& v, std::string& buffer) {
+        Serializer::serialize(v, [&](const void* data, size_t size) {
+            buffer.append(reinterpret_cast<const char*>(data), size);
+        });
+    }
+
+    // Stores 'v', or the 'n' serialized bytes at 'data' with split values
+    void store_entry(const K& k, [[maybe_unused]] const V* v, [[maybe_unused]] const char* data, [[maybe_unused]] size_t n, [[maybe_unused]] uint64_t expiry) {
+        writer_guard g{this};
+        size_t h = this->hash(k);
+        size_t seg = this->get_segment_index(m_hash, h);
+
+        // Incremental growth: only the segment receiving the key is split, a bounded amount of work
+        while(Self::get_segment(m_hash, seg)->fill >= SEGMENT_FILL) {
+            if(this->segment_live(seg) <= SEGMENT_FILL - (SEGMENT_SLOTS / 4)) {
+                this->purge_segment(seg);
+                break;
+            }
+
+            if(Self::get_segment(m_hash, seg)->depth >= MAX_DEPTH) break;
+            this->split_segment(seg, h);
+            seg = this->get_segment_index(m_hash, h);
+        }
+
+        slot_ref s = this->get_entry(h, k);
+        if(!s.ctrl) except("HashDB segment {} is full", seg);
+        this->uncache(s);
+
+        kv_pair& e = *s.kv;
+        const bool full = s.full();
+        m_hashdirty = true;
+
+        if(!full) {
+            e.hash = h;
+            this->store_key(e.key, k);
+            ++m_hash->size;
+        }
+
+        if(*s.ctrl == CTRL_EMPTY) {
+            ++m_hash->fill;
+            ++Self::get_segment(m_hash, seg)->fill;
+        }
+
+        if constexpr(SPLIT_VALUE) {
+            split_value& sv = e.value;
+            const bool spilled = full && sv.spilled();
+
+            if(n <= INLINE_VALUE) {
+                if(spilled) this->free_value(sv.extent);
+                std::copy_n(data, n, sv.data);
+                sv.size = static_cast<unsigned char>(n);
+            }
+            else {
+                if constexpr(FRAMED) {
+                    this->pack_value(data, n, m_pbuffer);
+                    data = m_pbuffer.data();
+                    n = m_pbuffer.size();
+                }
+
+                if(!spilled || n > sv.extent.capacity) {
+                    if(spilled) this->free_value(sv.extent);
+                    sv.extent = this->allocate_value(n);
+                    sv.size = SPILLED_VALUE;
+                }
+
+                std::copy_n(data, n, m_value + sv.extent.offset);
+            }
+
+            if constexpr(CHECKSUM) sv.checksum = this->stored_checksum(sv, m_value);
+        }
+        else {
+            e.value = *v;
+            if constexpr(CHECKSUM) e.checksum = Self::slot_checksum(e);
+        }
+
+        if constexpr(BLOOM) {
+            if(!full) Self::bloom_add(m_bloom, h);
+        }
+
+        if constexpr(CACHE) {
+            e.expiry = expiry;
+            if(expiry) this->schedule(seg, expiry);
+            this->reference(m_hash, s); // A new entry gets a turn before the hand takes it
+        }
+
+        *s.ctrl = Self::control_hash(h);
+
+        if constexpr(BLOOM) {
+            if(m_hash->size > m_bloom->capacity) this->rebuild_bloom();
+        }
+
+        if constexpr(CACHE) this->enforce_limits();
+    }
+
+    // Grows the table (one rehash() per doubling) and the value file up front for 'n' more entries
+    void reserve_entries(size_t n, [[maybe_unused]] size_t valuebytes) {
+        size_t fill = m_hash->fill + n;
+
+        if constexpr(CACHE) {
+            if(m_maxitems) fill = std::min(fill, m_maxitems);
+        }
+
+        while(m_hash->segments * 2 <= MAX_SEGMENTS && static_cast<float>(fill) > static_cast<float>(m_hash->capacity) * MAX_FILL_CAPACITY) {
+            size_t capacity = m_hash->capacity;
+            this->rehash();
+            if(m_hash->capacity == capacity) break;
+        }
+
+        if constexpr(SPLIT_VALUE) {
+            writer_guard g{this};
+
+            while(static_cast<float>(m_hash->valuesize + valuebytes) > static_cast<float>(m_hash->valuecapacity) * MAX_FILL_CAPACITY)
+                this->extend_value();
+        }
+    }
+
+    // Splits 'seg' into itself and a new segment, 'pattern' is any hash routed to 'seg'
+    void split_segment(size_t seg, size_t pattern) {
+        size_t depth = Self::get_segment(m_hash, seg)->depth;
+        assume(depth < MAX_DEPTH);
+        event_timer t{this, EVENT_SPLIT};
+
+        // Entries change slots, the directory may outgrow its area before the segments do
+        this->clear_cache();
+        const bool doubles = depth == m_hash->globaldepth;
+        if(m_hash->segments == m_hash->segmentcapacity || (doubles && (size_t{2} << depth) > Self::directory_capacity(m_hash->segmentcapacity)))
+            this->extend_hash();
+
+        uint32_t* directory = Self::get_directory(m_hash, m_hash->segmentcapacity);
+
+        if(doubles) {
+            size_t n = size_t{1} << m_hash->globaldepth;
+            std::copy_n(directory, n, directory + n);
+            ++m_hash->globaldepth;
+        }
+
+        size_t newseg = m_hash->segments++;
+        m_hash->capacity += SEGMENT_SLOTS;
+        m_hashdirty = true;
+
+        // Directory entries sharing the low 'depth' bits with bit 'depth' set move to the new segment
+        pattern &= (size_t{1} << depth) - 1;
+
+        for(size_t i = pattern | (size_t{1} << depth); i < (size_t{1} << m_hash->globaldepth); i += size_t{2} << depth)
+            directory[i] = static_cast<uint32_t>(newseg);
+
+        Self::get_segment(m_hash, newseg)->fill = 0;
+        Self::get_segment(m_hash, seg)->depth = Self::get_segment(m_hash, newseg)->depth = static_cast<unsigned char>(depth + 1);
+        if constexpr(CACHE) this->schedule_split(seg, newseg);
+        this->redistribute(seg, depth + 1);
+    }
+
+    // Rebuilds a segment whose free slots are mostly tombstones
+    void purge_segment(size_t seg) {
+        event_timer t{this, EVENT_PURGE};
+        this->clear_cache();
+        m_hashdirty = true;
+        this->redistribute(seg, Self::get_segment(m_hash, seg)->depth);
+    }
+
+    size_t segment_live(size_t seg) const {
+        const unsigned char* ctrl = Self::get_control(m_hash, seg);
+        size_t live = 0;
+        for(size_t i = 0; i < SEGMENT_SLOTS; ++i) live += (ctrl[i] & CTRL_FULL) != 0;
+        return live;
+    }
+
+    // Empties 'seg' and inserts its entries back where the directory and 'depth' route them, dropping tombstones
+    void redistribute(size_t seg, size_t depth) {
+        unsigned char* ctrl = Self::get_control(m_hash, seg);
+        kv_pair* slots = Self::get_slots(m_hash, seg);
+        m_segmentctrl.assign(ctrl, ctrl + SEGMENT_SLOTS);
+        m_segment.assign(slots, slots + SEGMENT_SLOTS);
+        std::fill_n(ctrl, SEGMENT_SLOTS, CTRL_EMPTY);
+
+        m_hash->fill -= Self::get_segment(m_hash, seg)->fill;
+        Self::get_segment(m_hash, seg)->fill = 0;
+
+        // Entries change slots: their reference bits start over
+        if constexpr(CACHE) {
+            for(size_t i = 0; i < SEGMENT_SLOTS / 64; ++i)
+                impl::atomic_store_relaxed(m_referenced[(seg * SEGMENT_SLOTS / 64) + i], uint64_t{0});
+        }
+
+        for(size_t i = 0; i < SEGMENT_SLOTS; ++i) {
+            if(!(m_segmentctrl[i] & CTRL_FULL)) continue;
+
+            const kv_pair& e = m_segment[i];
+            size_t h = e.hash;
+            size_t target = this->get_segment_index(m_hash, h);
+            unsigned char* tctrl = Self::get_control(m_hash, target);
+            size_t group = Self::home_group(h, depth);
+            uint32_t empty;
+
+            while(!(empty = impl::group_match(tctrl + group, CTRL_EMPTY)))
+                group = (group + impl::GROUP_SIZE) & (SEGMENT_SLOTS - 1);
+
+            size_t index = group + impl::lowest_bit(empty);
+            tctrl[index] = m_segmentctrl[i];
+            Self::get_slots(m_hash, target)[index] = e;
+            ++Self::get_segment(m_hash, target)->fill;
+            ++m_hash->fill;
+        }
+    }
+
+    void log_record(unsigned char op, const K* k = nullptr, const V* v = nullptr, [[maybe_unused]] uint64_t expiry = 0) {
+        auto w = [&](const void* data, size_t size) {
+            const char* p = reinterpret_cast<const char*>(data);
+            m_walbuffer.append(p, size);
+        };
+
+        size_t start = m_walbuffer.size();
+        m_walbuffer.resize(start + sizeof(wal_record));
+        m_walbuffer.push_back(static_cast<char>(op));
+        if(k) Serializer::serialize(*k, w);
+        if(v) Serializer::serialize(*v, w);
+
+        if constexpr(CACHE) {
+            if(op == OP_SET) w(&expiry, sizeof(expiry));
+        }
+
+        wal_record r;
+        r.size = static_cast<uint32_t>(m_walbuffer.size() - start - sizeof(wal_record));
+        r.checksum = static_cast<uint32_t>(impl::fnv1a(m_walbuffer.data() + start + sizeof(wal_record), r.size));
+        std::copy_n(reinterpret_cast<const char*>(&r), sizeof(r), m_walbuffer.data() + start);
+        if(op == OP_CLEAR || op == OP_GC) m_walop = op;
+    }
+
+    // Reads the valid prefix of the log, a torn or corrupted record ends it
+    static std::vector<std::string> read_log(impl::file_h h) {
+        std::string log(impl::size(h), 0);
+        if(!log.empty()) impl::pread(h, log.data(), log.size(), 0);
+
+        std::vector<std::string> records;
+
+        for(size_t pos = 0; pos + sizeof(wal_record) <= log.size(); ) {
+            wal_record r;
+            std::copy_n(log.data() + pos, sizeof(r), reinterpret_cast<char*>(&r));
+            pos += sizeof(r);
+
+            if(!r.size || r.size > log.size() - pos) break;
+            if(static_cast<uint32_t>(impl::fnv1a(log.data() + pos, r.size)) != r.checksum) break;
+
+            records.emplace_back(log, pos, r.size);
+            pos += r.size;
+        }
+
+        return records;
+    }
+
+    // Writes back the pages of a checkpoint interrupted in the middle of its in-place writes,
+    // a page log that is torn (the crash happened before it was synced) is ignored: the hash file was not touched yet
+    static void recover_checkpoint(const std::string& hashpath) {
+        std::string path = hashpath + impl::CHECKPOINT_SUFFIX;
+        if(!impl::is_file(path) || !impl::is_file(hashpath)) return;
+
+        impl::file_h h = impl::open(path);
+        const size_t size = impl::size(h);
+        checkpoint_header header{};
+        std::vector<std::pair<checkpoint_run, size_t>> runs; // Run and position of its bytes
+        std::string buffer;
+        bool valid = size >= sizeof(header);
+
+        if(valid) {
+            impl::pread(h, &header, sizeof(header), 0);
+            valid = header.signature == CHECKPOINT_SIGNATURE;
+        }
+
+        // Applying only part of the runs would mix two checkpoints: every run must be there
+        for(size_t i = 0, pos = sizeof(header); valid && i < header.runs; ++i) {
+            checkpoint_run r;
+            valid = pos + sizeof(r) <= size;
+            if(!valid) break;
+
+            impl::pread(h, &r, sizeof(r), pos);
+            pos += sizeof(r);
+            valid = r.size && r.size <= CHECKPOINT_RUN && r.size <= size - pos && r.offset + r.size <= header.hashsize;
+            if(!valid) break;
+
+            buffer.resize(r.size);
+            impl::pread(h, buffer.data(), r.size, pos);
+            valid = impl::crc32c(buffer.data(), r.size) == r.checksum;
+            runs.emplace_back(r, pos);
+            pos += r.size;
+        }
+
+        if(valid && !runs.empty()) {
+            impl::file_h fhash = impl::open(hashpath);
+            if(static_cast<size_t>(impl::size(fhash)) < header.hashsize) impl::resize(fhash, header.hashsize);
+
+            for(const auto& [r, pos] : runs) {
+                buffer.resize(r.size);
+                impl::pread(h, buffer.data(), r.size, pos);
+                impl::pwrite(fhash, buffer.data(), r.size, r.offset);
+            }
+
+            impl::sync(fhash);
+            impl::close(fhash);
+        }
+
+        impl::resize(h, 0);
+        impl::sync(h);
+        impl::close(h);
+    }
+
+    // Completes a collect_garbage() whose renames were committed, drops its files otherwise
+    static void recover_files(const std::string& hashpath, const std::string& path, const std::string& walpath) {
+        std::vector<std::string> records;
+
+        if(impl::is_file(walpath)) {
+            impl::file_h h = impl::open(walpath);
+            records = Self::read_log(h);
+            impl::close(h);
+        }
+
+        bool gc = records.size() == 1 && records.front().front() == static_cast<char>(OP_GC);
+
+        for(const std::string& filepath : {path + impl::VALUE_SUFFIX, path + impl::KEY_SUFFIX, hashpath}) {
+            std::string tmppath = filepath + impl::TMP_SUFFIX;
+
+            if(!gc) std::remove(tmppath.c_str());
+            else if(impl::is_file(tmppath)) impl::rename(tmppath, filepath);
+        }
+    }
+
+    void replay() {
+        std::vector<std::string> records = Self::read_log(m_fwal);
+
+        if constexpr(SPLIT_VALUE) {
+            // Extents popped since the checkpoint had their links overwritten: drop the free lists,
+            // their space shows up as dead bytes and compact() takes it back
+            if(!records.empty()) {
+                std::fill_n(m_hash->freelist, VALUE_CLASSES, 0);
+                m_hash->valuefree = m_hash->arenaend - m_hash->arenaoffset;
+            }
+        }
+
+        if constexpr(STRING_KEY) {
+            // Same for the key file, dropped tails stay unused until collect_garbage()
+            if(!records.empty()) {
+                std::fill_n(m_hash->keylist, VALUE_CLASSES, 0);
+                m_hash->keyfree = 0;
+            }
+        }
+
+        for(const std::string& record : records) {
+            const char* p = record.data() + 1;
+            const char* const end = record.data() + record.size();
+
+            auto r = [&](void* data, size_t size) {
+                assume(size <= static_cast<size_t>(end - p));
+                std::copy_n(p, size, reinterpret_cast<char*>(data));
+                p += size;
+            };
+
+            K k{};
 
-        m_hash = nullptr;
-        m_fhash = impl::INVALID_HANDLE;
-        m_fvalue = impl::INVALID_HANDLE;
+            switch(static_cast<unsigned char>(record.front())) {
+                case OP_SET: {
+                    V v{};
+                    uint64_t expiry = 0;
+                    Serializer::deserialize(k, r);
+                    Serializer::deserialize(v, r);
+                    if constexpr(CACHE) r(&expiry, sizeof(expiry));
+                    this->set_entry(k, v, expiry);
+                    break;
+                }
+
+                case OP_ERASE:
+                    Serializer::deserialize(k, r);
+                    this->erase_entry(k);
+                    break;
+
+                case OP_CLEAR: this->clear_entries(); break;
+                default: break;
+            }
+        }
+
+        this->checkpoint();
+    }
+
+    // Writes the pages of the private hash mapping dirtied since the last checkpoint back in place.
+    // They are written and synced to '<name>.hash.ckpt' first: a crash in the middle of the in-place writes
+    // finds them there on load. Each dirty page is written twice, clean pages are not written at all.
+    void write_back_hash() {
+        const size_t size = Self::hash_size(m_hash->segmentcapacity), page = impl::page_size();
+        std::vector<size_t> pages;
+
+        // Without pagemap every page counts as dirty
+        if(!impl::dirty_pages(m_hash, size, pages)) {
+            pages.clear();
+            for(size_t o = 0; o < size; o += page) pages.push_back(o);
+        }
+
+        // Contiguous pages are written as runs of up to CHECKPOINT_RUN bytes
+        std::vector<checkpoint_run> runs;
+        char* base = reinterpret_cast<char*>(m_hash);
+
+        for(size_t o : pages) {
+            size_t n = std::min(page, size - o);
+
+            if(!runs.empty() && runs.back().offset + runs.back().size == o && runs.back().size + n <= CHECKPOINT_RUN)
+                runs.back().size += n;
+            else
+                runs.push_back({o, n, 0});
+        }
+
+        const std::string path = m_fhashpath + impl::CHECKPOINT_SUFFIX;
+        const bool created = !impl::is_file(path);
+        impl::file_h h = impl::open(path);
+        impl::resize(h, 0);
+
+        // Also makes the entries of the files created with the table durable
+        if(created) impl::sync_directory(path);
+
+        size_t pos = sizeof(checkpoint_header);
+
+        for(checkpoint_run& r : runs) {
+            r.checksum = impl::crc32c(base + r.offset, r.size);
+            impl::pwrite(h, &r, sizeof(r), pos);
+            impl::pwrite(h, base + r.offset, r.size, pos + sizeof(r));
+            pos += sizeof(r) + r.size;
+        }
+
+        checkpoint_header header{CHECKPOINT_SIGNATURE, runs.size(), size};
+        impl::pwrite(h, &header, sizeof(header), 0);
+        impl::sync(h);
+
+        for(const checkpoint_run& r : runs) impl::pwrite(m_fhash, base + r.offset, r.size, r.offset);
+        impl::sync(m_fhash);
+
+        // The hash file is complete: the page log is not needed anymore and the private copies can go
+        impl::resize(h, 0);
+        impl::close(h);
+        for(const checkpoint_run& r : runs) impl::discard(base + r.offset, r.size);
+        m_hashdirty = false;
+    }
+
+    // Writes the whole (privately mapped) hash table to 'path' and syncs it
+    impl::file_h write_hashfile(const std::string& path) {
+        size_t size = Self::hash_size(m_hash->segmentcapacity);
+        impl::file_h newfile = impl::open(path);
+        assume(newfile != impl::INVALID_HANDLE);
+        impl::resize(newfile, 0);
+        impl::pwrite(newfile, m_hash, size, 0);
+        impl::sync(newfile);
+        return newfile;
+    }
+
+    // Maps the freshly written hash file, dropping the private copy of the old one
+    void replace_hashfile(impl::file_h newfile) {
+        size_t size = Self::hash_size(m_hash->segmentcapacity);
+        impl::close(m_fhash);
+        m_fhash = newfile;
+
+        hash_header* newhash = impl::mmap<hash_header>(m_fhash, size, WAL);
+        assume(newhash);
+        this->retire(m_hash, size);
+        impl::atomic_store(m_hash, newhash);
+        m_hashdirty = false;
+        this->reclaim();
+        this->apply_access();
+    }
+
+    // Calls f(kv_pair) for every full slot, in slot order
+    template<typename Function>
+    void for_each_entry(Function f) const {
+        for(size_t seg = 0; seg < m_hash->segments; ++seg) {
+            const unsigned char* ctrl = Self::get_control(m_hash, seg);
+            const kv_pair* e = Self::get_slots(m_hash, seg);
+
+            for(size_t i = 0; i < SEGMENT_SLOTS; ++i) {
+                if(ctrl[i] & CTRL_FULL) f(e[i]);
+            }
+        }
+    }
+
+    // Calls that read the files as a whole or hand out views into them commit the batch get() already sees.
+    // Only a table that was written to has one: a const table never gets past the check.
+    void commit_pending() const {
+        if constexpr(WAL && !CONCURRENT) {
+            if(!m_walbuffer.empty()) const_cast<Self*>(this)->commit();
+        }
+    }
+
+    size_t scan_threads(size_t threads) const {
+        if(!threads) threads = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+        return std::max<size_t>(std::min<size_t>(threads, m_hash->segments), 1);
+    }
+
+    // Runs f(t, kv_pair, value) for every full slot on 'threads' workers, each claiming the next unscanned segment.
+    // Slots are read straight from the mapping, spilled values are prefetched a few slots ahead of their use.
+    template<typename Function>
+    void scan_parallel(size_t threads, Function f) const {
+        this->commit_pending();
+        const size_t segments = m_hash->segments;
+        const uint64_t now = CACHE ? Self::now() : 0;
+        size_t next = 0;
+
+        impl::parallel(threads, [&](size_t t) {
+            V v{};
+
+            for(size_t seg = impl::atomic_add(next, size_t{1}) - 1; seg < segments; seg = impl::atomic_add(next, size_t{1}) - 1) {
+                const unsigned char* ctrl = Self::get_control(m_hash, seg);
+                const kv_pair* e = Self::get_slots(m_hash, seg);
+
+                for(size_t i = 0; i < SEGMENT_SLOTS; ++i) {
+                    if constexpr(SPLIT_VALUE) {
+                        size_t ahead = i + PIPELINE_DISTANCE;
+
+                        if(ahead < SEGMENT_SLOTS && (ctrl[ahead] & CTRL_FULL) && e[ahead].value.spilled())
+                            impl::prefetch(m_value + e[ahead].value.extent.offset);
+                    }
+
+                    if(!(ctrl[i] & CTRL_FULL) || Self::expired(e[i], now)) continue;
+
+                    if constexpr(SPLIT_VALUE) {
+                        this->get_value(e[i], v);
+                        f(t, e[i], v);
+                    }
+                    else
+                        f(t, e[i], this->checked_value(e[i]));
+                }
+            }
+        });
+    }
+
+    // Renames 'tmppath' over 'path', then publishes a mapping of 'newfile' and retires the old one
+    void replace_file(const std::string& tmppath, const std::string& path, impl::file_h newfile, impl::file_h& h, char*& m, size_t capacity) {
+        impl::rename(tmppath, path);
+        impl::close(h);
+        h = newfile;
+
+        char* newm = impl::mmap<char>(h, capacity);
+        assume(newm);
+        this->retire(m, capacity);
+        impl::atomic_store(m, newm);
+        this->apply_access();
+    }
+
+    static constexpr size_t SEGMENT_SIZE = sizeof(segment_header) + (SEGMENT_SLOTS * (1 + sizeof(kv_pair)));
+
+    // The directory follows the last segment the file can hold, 'segments' is that capacity
+    static size_t directory_capacity(size_t segments) { return segments * DIRECTORY_RATIO; }
+    static size_t hash_size(size_t segments) { return sizeof(hash_header) + (segments * SEGMENT_SIZE) + (Self::directory_capacity(segments) * sizeof(uint32_t)); }
+    static segment_header* get_segment(const hash_header* h, size_t seg) { return reinterpret_cast<segment_header*>(reinterpret_cast<char*>(const_cast<hash_header*>(h) + 1) + (seg * SEGMENT_SIZE)); }
+    static uint32_t* get_directory(const hash_header* h, size_t segments) { return reinterpret_cast<uint32_t*>(Self::get_segment(h, segments)); }
+    static unsigned char* get_control(const hash_header* h, size_t seg) { return reinterpret_cast<unsigned char*>(Self::get_segment(h, seg) + 1); }
+    static kv_pair* get_slots(const hash_header* h, size_t seg) { return reinterpret_cast<kv_pair*>(Self::get_control(h, seg) + SEGMENT_SLOTS); }
+
+    // 7 bits of the hash, mixed so that identity hashes of small integers still spread
+    static unsigned char control_hash(size_t h) { return static_cast<unsigned char>(CTRL_FULL | ((static_cast<uint64_t>(h) * 0x9e3779b97f4a7c15ULL) >> 57)); }
+    static size_t home_group(size_t h, size_t depth) { return (h >> depth) & (SEGMENT_SLOTS - 1) & ~(impl::GROUP_SIZE - 1); }
+
+    static size_t get_segment_index(const hash_header* h, size_t hash) { return Self::get_segment_index(h, h->segmentcapacity, hash); }
+
+    // Readers pass the capacity they loaded, a 'globaldepth' running past that directory returns 'segments' (a miss)
+    static size_t get_segment_index(const hash_header* h, size_t segments, size_t hash) {
+        size_t depth = std::min<size_t>(h->globaldepth, MAX_DEPTH);
+        size_t i = hash & ((size_t{1} << depth) - 1);
+        if(i >= Self::directory_capacity(segments)) return segments;
+        return Self::get_directory(h, segments)[i];
+    }
+
+    static size_t value_class(size_t n) {
+        if(n <= (size_t{1} << MIN_EXTENT_BITS)) return 0;
+        return (sizeof(unsigned long long) * 8) - static_cast<size_t>(__builtin_clzll(n - 1)) - MIN_EXTENT_BITS;
+    }
+
+    static size_t class_size(size_t c) { return size_t{1} << (c + MIN_EXTENT_BITS); }
+
+    // Free lists store 'offset + 1', zero terminates them
+    // 'packed' takes the arena before the free lists: compact() moves values there
+    hash_offset_value allocate_value(size_t n, bool packed = false) {
+        size_t c = Self::value_class(n);
+        hash_offset_value ov{Self::class_size(c), 0};
+
+        if(packed && this->carve_arena(ov)) {
+            this->account_value(ov, true);
+            return ov;
+        }
+
+        while(m_hash->freelist[c]) {
+            ov.offset = m_hash->freelist[c] - 1;
+            std::copy_n(m_value + ov.offset, sizeof(size_t), reinterpret_cast<char*>(&m_hash->freelist[c]));
+            m_hash->valuefree -= ov.capacity;
+            if(m_compaction.cls == c && m_compaction.prev == ov.offset + 1) m_compaction.prev = 0;
+
+            // Extents of the region being drained are dropped, it is reused as a whole
+            if(this->in_draining_region(ov)) continue;
+            this->account_value(ov, true);
+            return ov;
+        }
+
+        if(!this->carve_arena(ov)) {
+            while(m_hash->valuesize + ov.capacity > m_hash->valuecapacity || this->values_filled() > MAX_FILL_CAPACITY)
+                this->extend_value();
+
+            ov.offset = m_hash->valuesize;
+            m_hash->valuesize += ov.capacity;
+        }
+
+        this->account_value(ov, true);
+        return ov;
+    }
+
+    bool carve_arena(hash_offset_value& ov) {
+        if(m_hash->arenaend - m_hash->arenaoffset < ov.capacity) {
+            if(ov.capacity > (size_t{1} << m_hash->regionbits) || !this->next_arena()) return false;
+        }
+
+        ov.offset = m_hash->arenaoffset;
+        m_hash->arenaoffset += ov.capacity;
+        m_hash->valuefree -= ov.capacity;
+        return true;
+    }
+
+    void free_value(const hash_offset_value& ov) {
+        this->account_value(ov, false);
+        m_compactfreed += ov.capacity;
+        if(!this->in_draining_region(ov)) this->push_value(ov);
+    }
+
+    void push_value(const hash_offset_value& ov) {
+        size_t c = Self::value_class(ov.capacity);
+        std::copy_n(reinterpret_cast<const char*>(&m_hash->freelist[c]), sizeof(size_t), m_value + ov.offset);
+        m_hash->freelist[c] = ov.offset + 1;
+        m_hash->valuefree += ov.capacity;
+    }
+
+    // Adds or removes the extent's bytes to the live count of the regions it overlaps
+    void account_value(const hash_offset_value& ov, bool live) {
+        const size_t bits = m_hash->regionbits;
+
+        for(size_t o = ov.offset, end = ov.offset + ov.capacity; o < end; ) {
+            size_t r = o >> bits;
+            size_t n = std::min(end, (r + 1) << bits) - o;
+
+            if(live) m_hash->regionlive[r] += n;
+            else m_hash->regionlive[r] -= n;
+            o += n;
+        }
+    }
+
+    bool in_draining_region(const hash_offset_value& ov) const {
+        if(m_compaction.phase == COMPACT_IDLE) return false;
+        size_t start = m_compaction.region << m_hash->regionbits;
+        size_t end = start + (size_t{1} << m_hash->regionbits);
+        return ov.offset < end && ov.offset + ov.capacity > start;
+    }
+
+    // Picks the last region, or else the one with the fewest live bytes, outside of the arena and the reclaimed regions.
+    // Regions are only rescanned after enough bytes were freed.
+    bool begin_compaction() {
+        const size_t regionsize = size_t{1} << m_hash->regionbits;
+        if(m_compactfreed < (regionsize >> 1)) return false;
+
+        const size_t regions = m_hash->valuesize >> m_hash->regionbits;
+        const size_t last = m_hash->valuesize ? (m_hash->valuesize - 1) >> m_hash->regionbits : 0;
+        const size_t lastend = (last + 1) << m_hash->regionbits;
+        const size_t arena = m_hash->arenaend - m_hash->arenaoffset;
+        const size_t arenaregion = arena ? m_hash->arenaoffset >> m_hash->regionbits : VALUE_REGIONS;
+        size_t region = regions, live = static_cast<size_t>(regionsize * MAX_COMPACT_LIVE);
+
+        // Draining the last region ends the file there, it goes first
+        if(m_hash->valuesize && last != arenaregion && lastend <= m_hash->valuecapacity && m_hash->regionlive[last] < live)
+            region = last;
+        else {
+            for(size_t i = 0; i < regions; ++i) {
+                if(i == arenaregion || m_hash->regionlive[i] >= live) continue;
+                live = m_hash->regionlive[i];
+                region = i;
+            }
+
+            if(region == regions) {
+                m_compactfreed = 0;
+                return false;
+            }
+        }
+
+        // A partly used last region is sealed, values are never appended back into it
+        if(region == last) m_hash->valuesize = lastend;
+        m_compaction = {COMPACT_PURGE, region, 0, 0, 0};
+        return true;
+    }
+
+    // Hands the arena leftover to the free lists
+    void release_arena() {
+        const size_t minextent = Self::class_size(0);
+
+        while(m_hash->arenaend - m_hash->arenaoffset >= minextent) {
+            size_t n = m_hash->arenaend - m_hash->arenaoffset;
+            size_t c = (sizeof(unsigned long long) * 8) - 1 - static_cast<size_t>(__builtin_clzll(n)) - MIN_EXTENT_BITS;
+            hash_offset_value ov{Self::class_size(c), m_hash->arenaoffset};
+
+            m_hash->arenaoffset += ov.capacity;
+            m_hash->valuefree -= ov.capacity;
+            this->push_value(ov);
+        }
+
+        m_hash->valuefree -= m_hash->arenaend - m_hash->arenaoffset;
+        m_hash->arenaoffset = m_hash->arenaend = 0;
+    }
+
+    // Unlinks the next free extent if it overlaps the draining region, returns the work done
+    size_t purge_step() {
+        compaction& c = m_compaction;
+
+        if(c.cls == VALUE_CLASSES) {
+            c.phase = COMPACT_EVACUATE;
+            c.cursor = 0;
+            return 0;
+        }
+
+        char* link = c.prev ? m_value + c.prev - 1 : reinterpret_cast<char*>(m_hash->freelist + c.cls);
+        hash_offset_value ov{Self::class_size(c.cls), 0};
+        size_t node;
+        std::copy_n(link, sizeof(size_t), reinterpret_cast<char*>(&node));
+
+        if(!node) {
+            ++c.cls;
+            c.prev = 0;
+            return COMPACT_SCAN_COST;
+        }
+
+        ov.offset = node - 1;
+
+        if(this->in_draining_region(ov)) {
+            std::copy_n(m_value + ov.offset, sizeof(size_t), link);
+            m_hash->valuefree -= ov.capacity;
+        }
+        else
+            c.prev = node;
+
+        return COMPACT_SCAN_COST;
+    }
+
+    // Moves the value of the slot under the cursor out of the draining region, returns the work done
+    size_t evacuate_step() {
+        compaction& c = m_compaction;
+
+        if(!m_hash->regionlive[c.region]) {
+            if constexpr(WAL) c.phase = COMPACT_RECLAIM; // Deferred to checkpoint()
+            else this->reclaim_region();
+            return 0;
+        }
+
+        // A split may move entries behind the cursor: sweep again until the region is empty
+        if(c.cursor >= m_hash->capacity) c.cursor = 0;
+        size_t seg = c.cursor / SEGMENT_SLOTS, i = c.cursor % SEGMENT_SLOTS;
+        ++c.cursor;
+
+        if(!(Self::get_control(m_hash, seg)[i] & CTRL_FULL)) return COMPACT_SCAN_COST;
+        split_value& sv = Self::get_slots(m_hash, seg)[i].value;
+        if(!sv.spilled() || !this->in_draining_region(sv.extent)) return COMPACT_SCAN_COST;
+
+        hash_offset_value& ov = sv.extent;
+
+        hash_offset_value moved = this->allocate_value(ov.capacity, true);
+        std::copy_n(m_value + ov.offset, ov.capacity, m_value + moved.offset);
+        this->account_value(ov, false);
+        ov = moved;
+        return COMPACT_SCAN_COST + moved.capacity;
+    }
+
+    // Releases the blocks of the drained region: the last one ends the file there, along with the reclaimed
+    // regions before it, the others are marked REGION_RECLAIMED until they become the arena
+    void reclaim_region() {
+        const size_t bits = m_hash->regionbits;
+        const size_t region = m_compaction.region;
+
+        m_compaction = {};
+        impl::punch_hole(m_fvalue, region << bits, size_t{1} << bits);
+
+        if(((region + 1) << bits) < m_hash->valuesize) {
+            m_hash->regionlive[region] = REGION_RECLAIMED;
+            ++m_reclaimed;
+            return;
+        }
+
+        m_hash->valuesize = region << bits;
+
+        while(m_hash->valuesize && m_hash->regionlive[(m_hash->valuesize - 1) >> bits] == REGION_RECLAIMED) {
+            m_hash->valuesize -= size_t{1} << bits;
+            m_hash->regionlive[m_hash->valuesize >> bits] = 0;
+            --m_reclaimed;
+        }
+    }
+
+    // Makes the first reclaimed region the arena, the previous leftover goes to the free lists
+    bool next_arena() {
+        if(!m_reclaimed) return false;
+
+        const size_t bits = m_hash->regionbits;
+        size_t region = 0;
+        while(m_hash->regionlive[region] != REGION_RECLAIMED) ++region;
+
+        this->release_arena();
+        m_hash->regionlive[region] = 0;
+        --m_reclaimed;
+        m_hash->arenaoffset = region << bits;
+        m_hash->arenaend = m_hash->arenaoffset + (size_t{1} << bits);
+        m_hash->valuefree += size_t{1} << bits;
+        return true;
+    }
+
+    size_t count_reclaimed() const { return static_cast<size_t>(std::count(m_hash->regionlive, m_hash->regionlive + VALUE_REGIONS, REGION_RECLAIMED)); }
+
+    K load_key(const stored_key& sk) const {
+        if constexpr(STRING_KEY) {
+            K k{sk.prefix, std::min<size_t>(sk.size, KEY_PREFIX)};
+            if(sk.size > KEY_PREFIX) k.append(m_key + sk.offset, sk.size - KEY_PREFIX);
+            return k;
+        }
+        else
+            return sk;
+    }
+
+    // Hashes are compared first, string keys only touch the key file once size and prefix match too.
+    // A concurrent reader may see a torn slot: the tail is bounds checked, the caller retries anyway.
+    bool key_equals(const hash_header* hh, const kv_pair& e, size_t h, const K& k) const {
+        if(e.hash != h) return false;
+
+        if constexpr(STRING_KEY) {
+            const string_key& sk = e.key;
+            if(sk.size != k.size()) return false;
+            if(std::memcmp(sk.prefix, k.data(), std::min<size_t>(k.size(), KEY_PREFIX))) return false;
+            if(k.size() <= KEY_PREFIX) return true;
+
+            size_t n = k.size() - KEY_PREFIX;
+            size_t keycapacity = impl::atomic_load(hh->keycapacity);
+            const char* keys = impl::atomic_load(m_key);
+            if(n > keycapacity || sk.offset > keycapacity - n) return false;
+            return !std::memcmp(keys + sk.offset, k.data() + KEY_PREFIX, n);
+        }
+        else
+            return e.key == k;
+    }
+
+    static hash_offset_value key_extent(const string_key& sk) { return {Self::class_size(Self::value_class(sk.size - KEY_PREFIX)), sk.offset}; }
+
+    void store_key(stored_key& sk, const K& k) {
+        if constexpr(STRING_KEY) {
+            if(k.size() > std::numeric_limits<uint32_t>::max()) except("Key too long ({} bytes)", k.size());
+
+            sk.size = static_cast<uint32_t>(k.size());
+            sk.offset = 0;
+            std::fill_n(sk.prefix, KEY_PREFIX, 0);
+            std::copy_n(k.data(), std::min<size_t>(k.size(), KEY_PREFIX), sk.prefix);
+
+            if(k.size() > KEY_PREFIX) {
+                sk.offset = this->allocate_key(k.size() - KEY_PREFIX).offset;
+                std::copy_n(k.data() + KEY_PREFIX, k.size() - KEY_PREFIX, m_key + sk.offset);
+            }
+        }
+        else
+            sk = k;
+    }
+
+    // Key tails use the value size classes, without arena or compaction
+    hash_offset_value allocate_key(size_t n) {
+        size_t c = Self::value_class(n);
+        hash_offset_value ov{Self::class_size(c), 0};
+
+        if(m_hash->keylist[c]) {
+            ov.offset = m_hash->keylist[c] - 1;
+            std::copy_n(m_key + ov.offset, sizeof(size_t), reinterpret_cast<char*>(&m_hash->keylist[c]));
+            m_hash->keyfree -= ov.capacity;
+            return ov;
+        }
+
+        while(m_hash->keysize + ov.capacity > m_hash->keycapacity)
+            this->extend_key();
+
+        ov.offset = m_hash->keysize;
+        m_hash->keysize += ov.capacity;
+        return ov;
+    }
+
+    void free_key(const stored_key& sk) {
+        if constexpr(STRING_KEY) {
+            if(sk.size <= KEY_PREFIX) return;
+
+            this->push_key(Self::key_extent(sk));
+        }
+    }
+
+    void push_key(const hash_offset_value& ov) {
+        size_t c = Self::value_class(ov.capacity);
+        std::copy_n(reinterpret_cast<const char*>(&m_hash->keylist[c]), sizeof(size_t), m_key + ov.offset);
+        m_hash->keylist[c] = ov.offset + 1;
+        m_hash->keyfree += ov.capacity;
+    }
+
+    float values_filled() { return static_cast<float>(m_hash->valuesize) / static_cast<float>(m_hash->valuecapacity); }
+
+    void get_value(const kv_pair& e, V& v) const {
+        if constexpr(SPLIT_VALUE) {
+            thread_local std::string buffer;
+            Self::deserialize_value(this->value_bytes(e.value, buffer).data(), v);
+        }
+        else
+            v = this->checked_value(e);
+    }
+
+    // Unserialized values are checked as they are in the slot
+    const V& checked_value(const kv_pair& e) const {
+        if constexpr(CHECKSUM) {
+            if(Self::slot_checksum(e) != e.checksum) except("Value checksum mismatch");
+        }
+
+        return e.value;
+    }
+
+    static uint32_t slot_checksum(const kv_pair& e) { return impl::crc32c(&e.value, sizeof(V)); }
+
+    static void deserialize_value(const char* p, V& v) {
+        Serializer::deserialize(v, [&](void* data, size_t size) {
+            std::copy_n(p, size, reinterpret_cast<char*>(data));
+            p += size;
+        });
+    }
+
+    // Queues the read of the extent holding the value of 'k', false when it does not come from the value file
+    template<typename Function>
+    bool queue_read(const K& k, Function& f) const {
+        if constexpr(WAL) {
+            if(m_pending.count(k)) return false;
+        }
+
+        size_t h = this->hash(k);
+        if(!m_hash->size || this->bloom_rejects(h)) return false;
+        slot_ref s = this->get_entry(h, k);
+        if(!this->hit(m_hash, s) || !s.kv->value.spilled()) return false;
+
+        // Completions may queue reads themselves: make room before holding on to m_reads
+        split_value sv = s.kv->value;
+        while(m_inflight >= m_iodepth) this->complete_reads(1);
+
+        size_t tag = m_reads.size();
+
+        if(m_readfree.empty())
+            m_reads.emplace_back();
+        else {
+            tag = m_readfree.back();
+            m_readfree.pop_back();
+        }
+
+        async_read& r = m_reads[tag];
+        r.key = k;
+        r.value = sv;
+        r.data.resize(sv.extent.capacity);
+        r.callback = std::move(f);
+        ++m_inflight;
+
+        if(!m_ring.valid()) {
+            impl::pread(m_fvalue, r.data.data(), r.data.size(), sv.extent.offset);
+            this->complete_read(tag, static_cast<int>(r.data.size()));
+        }
+        else
+            assume(m_ring.read(m_fvalue, r.data.data(), r.data.size(), sv.extent.offset, tag));
+
+        return true;
+    }
+
+    // Submits the queued reads, waits for 'wait' of them, then completes every finished one
+    size_t complete_reads(unsigned wait) const {
+        constexpr unsigned BATCH = 64;
+        std::pair<uint64_t, int> done[BATCH];
+        size_t count = 0;
+
+        m_ring.submit(wait);
+
+        for(;;) {
+            unsigned n = 0;
+            m_ring.reap(BATCH, [&](uint64_t tag, int res) { done[n++] = {tag, res}; });
+            for(unsigned i = 0; i < n; ++i) this->complete_read(done[i].first, done[i].second);
+            count += n;
+            if(n < BATCH) return count;
+        }
+    }
+
+    void complete_read(size_t tag, int res) const {
+        async_read& r = m_reads[tag];
+
+        // Short or failed reads (IORING_OP_READ needs Linux 5.6) are done again synchronously
+        if(res < 0 || static_cast<size_t>(res) != r.data.size())
+            impl::pread(m_fvalue, r.data.data(), r.data.size(), r.value.extent.offset);
+
+        thread_local std::string buffer;
+        std::optional<V> v{std::in_place};
+        Self::deserialize_value(this->extent_bytes(r.value, r.data.data(), buffer).data(), *v);
+
+        // The callback may queue reads itself, which can reuse this entry
+        K k = std::move(r.key);
+        std::function<void(const K&, std::optional<V>)> f = std::move(r.callback);
+        r.callback = nullptr;
+        m_readfree.push_back(tag);
+        --m_inflight;
+        f(k, std::move(v));
+    }
+
+    // Frames the serialized bytes of a spilled value into 'out', compressing them when enabled
+    void pack_value(const char* data, size_t n, std::string& out) const {
+        if constexpr(COMPRESS) impl::lz_pack(data, n, out, this->dictionary(m_hash), m_dictindex.data());
+        else impl::lz_store(data, n, out);
+    }
+
+    // The serialized bytes of a value: stored frames are viewed in place, compressed ones are unpacked into 'buffer'.
+    // Unframed spilled values are viewed with their whole extent, their serialized size is not stored.
+    std::string_view value_bytes(const split_value& sv, std::string& buffer) const {
+        if(sv.spilled()) return this->extent_bytes(sv, m_value + sv.extent.offset, buffer);
+
+        if constexpr(CHECKSUM) {
+            if(this->stored_checksum(sv, m_value) != sv.checksum) except("Value checksum mismatch");
+        }
+
+        return {sv.data, sv.size};
+    }
+
+    // Same as value_bytes() for a spilled value whose extent was read at 'p'
+    std::string_view extent_bytes(const split_value& sv, const char* p, [[maybe_unused]] std::string& buffer) const {
+        if constexpr(CHECKSUM) {
+            if(this->extent_checksum(p, sv.extent.capacity) != sv.checksum) except("Value checksum mismatch");
+        }
+
+        if constexpr(FRAMED) {
+            impl::lz_frame f;
+            std::memcpy(&f, p, sizeof(f));
+
+            if(f.packedsize == f.rawsize && f.rawsize <= sv.extent.capacity - sizeof(f))
+                return {p + sizeof(f), f.rawsize};
+
+            if(!impl::lz_unpack(p, sv.extent.capacity, buffer, this->dictionary(m_hash))) except("Corrupted value at offset {}", sv.extent.offset);
+            return buffer;
+        }
+        else
+            return {p, sv.extent.capacity};
+    }
+
+    // CRC32C of what a value occupies: its inline bytes or its frame
+    uint32_t stored_checksum(const split_value& sv, const char* values) const {
+        if(!sv.spilled()) return impl::crc32c(sv.data, std::min<size_t>(sv.size, INLINE_VALUE));
+        return this->extent_checksum(values + sv.extent.offset, sv.extent.capacity);
+    }
+
+    uint32_t extent_checksum(const char* p, size_t n) const {
+        if constexpr(FRAMED) {
+            impl::lz_frame f;
+            std::memcpy(&f, p, sizeof(f));
+            n = std::min<size_t>(n, sizeof(f) + f.packedsize);
+        }
+
+        return impl::crc32c(p, n);
+    }
+
+    std::string_view dictionary([[maybe_unused]] const hash_header* hh) const {
+        if constexpr(COMPRESS) return {hh->dictionary, std::min<size_t>(hh->dictsize, DICTIONARY_SIZE)};
+        else return {};
+    }
+
+    size_t hash(const K& k) const { return Hasher::hash(k); }
+
+    bool contains_hashed(size_t h, const K& k) const {
+        if constexpr(WAL && !CONCURRENT) {
+            auto it = m_pending.find(k);
+            if(it != m_pending.end()) return it->second.has_value();
+        }
+
+        if constexpr(CONCURRENT) {
+            reader_guard g{this};
+            if(this->bloom_rejects(h)) return false;
+            bool found = false;
+
+            this->read_consistent([&](const hash_header* hh, size_t segments, const char*, size_t) {
+                found = this->hit(hh, this->find_entry(hh, segments, h, k));
+                return true;
+            });
+
+            return found;
+        }
+        else
+            return m_hash->size && !this->bloom_rejects(h) && this->hit(m_hash, this->get_entry(h, k));
+    }
+
+    bool get_hashed(size_t h, const K& k, V& v) const {
+        if constexpr(WAL && !CONCURRENT) {
+            auto it = m_pending.find(k);
+
+            if(it != m_pending.end()) {
+                if(it->second) v = *it->second;
+                return it->second.has_value();
+            }
+        }
+
+        if constexpr(CONCURRENT) {
+            reader_guard g{this};
+            if(this->bloom_rejects(h)) return false;
+            thread_local std::string rbuffer;
+            kv_pair e;
+            bool found = false, intact = true;
+
+            // Copy the slot and its serialized bytes, deserialize once the copy is known to be consistent
+            bool ok = this->read_consistent([&](const hash_header* hh, size_t segments, const char* values, size_t valuecapacity) {
+                slot_ref s = this->find_entry(hh, segments, h, k);
+                found = this->hit(hh, s);
+                if(!found) return true;
+                e = *s.kv;
+
+                if constexpr(SPLIT_VALUE) {
+                    const split_value& sv = e.value;
+
+                    if(!sv.spilled()) {
+                        if(sv.size > INLINE_VALUE) return false;
+                        rbuffer.assign(sv.data, sv.size);
+                        if constexpr(CHECKSUM) intact = this->stored_checksum(sv, values) == sv.checksum;
+                    }
+                    else {
+                        const hash_offset_value& ov = sv.extent;
+                        if(ov.capacity > valuecapacity || ov.offset > valuecapacity - ov.capacity) return false;
+
+                        if constexpr(CHECKSUM) {
+                            intact = this->stored_checksum(sv, values) == sv.checksum;
+                            if(!intact) return true;
+                        }
+
+                        // The dictionary is only stable within the snapshot, a torn frame fails to unpack
+                        if constexpr(FRAMED) return impl::lz_unpack(values + ov.offset, ov.capacity, rbuffer, this->dictionary(hh));
+                        else rbuffer.assign(values + ov.offset, ov.capacity);
+                    }
+                }
+
+                return true;
+            });
+
+            if(!ok || !found) return false;
+            if(!intact) except("Value checksum mismatch"); // Found in a consistent snapshot: not a torn read
+
+            if constexpr(SPLIT_VALUE) {
+                const char* p = rbuffer.data();
 
-        if constexpr(Flags & hashdb_flags_remove) {
-            if(!m_fvaluepath.empty()) std::remove(m_fvaluepath.c_str());
-            if(!m_fhashpath.empty()) std::remove(m_fhashpath.c_str());
-            m_fvaluepath.clear();
-            m_fhashpath.clear();
+                Serializer::deserialize(v, [&](void* data, size_t size) {
+                    std::copy_n(p, size, reinterpret_cast<char*>(data));
+                    p += size;
+                });
+            }
+            else
+                v = this->checked_value(e);
+
+            return true;
+        }
+        else {
+            if(!m_hash->size || this->bloom_rejects(h)) return false;
+            slot_ref s = this->get_entry(h, k);
+            if(!this->hit(m_hash, s)) return false;
+            this->get_value(*s.kv, v);
+            return true;
         }
     }
 
-    void open(const std::string& name, std::string basepath = std::string{}) {
-        assume(!name.empty());
-        if(!basepath.empty()) basepath.append(impl::PATH_SEPARATOR);
+    // Runs f(hash, key) over 'keys' while prefetching a few keys ahead: first the control group,
+    // then the slot it points to, then (split values) the value extent of that slot
+    template<typename Function>
+    void pipeline(const K* keys, size_t n, Function f) const {
+        constexpr size_t D = PIPELINE_DISTANCE;
+        size_t hashes[4 * D];
+        const kv_pair* candidates[4 * D];
 
-        m_fhashpath = basepath + name + ".hash";
-        this->reinit_hashfile(DEFAULT_ITEMS_COUNT, true);
+        // Prefetching only needs a mapping that stays alive, a torn read just prefetches the wrong line
+        reader_guard g{this};
+        const hash_header* hh;
+        size_t segments;
 
-        m_hash->integersize = sizeof(size_t);
-        m_hash->signature = SIGNATURE;
-        m_hash->capacity = DEFAULT_ITEMS_COUNT;
-        m_hash->valuesize = 0;
-        m_hash->size = 0;
-        m_hash->fill = 0;
+        do {
+            hh = impl::atomic_load(m_hash);
+            segments = impl::atomic_load(hh->segmentcapacity);
+        } while(impl::atomic_load(m_hash) != hh);
 
-        if constexpr(SPLIT_VALUE) {
-            m_fvaluepath = basepath + name + impl::VALUE_SUFFIX;
-            m_hash->valuecapacity = DEFAULT_ITEMS_COUNT * sizeof(V);
-            this->reinit_valuefile(m_hash->valuecapacity);
+        const bloom_header* bloom = impl::atomic_load(m_bloom);
+
+        for(size_t i = 0; i < n + (3 * D); ++i) {
+            if(i < n) {
+                size_t h = hashes[i % (4 * D)] = this->hash(keys[i]);
+                size_t seg = Self::get_segment_index(hh, segments, h);
+                if constexpr(BLOOM) impl::prefetch(Self::bloom_block_of(bloom, impl::mix64(h)));
+                if(seg < segments) impl::prefetch(Self::get_control(hh, seg) + Self::home_group(h, std::min<size_t>(Self::get_segment(hh, seg)->depth, MAX_DEPTH)));
+            }
+
+            if(i >= D && i - D < n) {
+                size_t h = hashes[(i - D) % (4 * D)];
+                size_t seg = Self::get_segment_index(hh, segments, h);
+                const kv_pair*& candidate = candidates[(i - D) % (4 * D)];
+                candidate = nullptr;
+
+                // Reading the control bytes of a miss would fault them in, the filter has the answer
+                if(seg < segments && !Self::bloom_rejects(bloom, h)) {
+                    size_t group = Self::home_group(h, std::min<size_t>(Self::get_segment(hh, seg)->depth, MAX_DEPTH));
+                    uint32_t m = impl::group_match(Self::get_control(hh, seg) + group, Self::control_hash(h));
+
+                    if(m) {
+                        candidate = Self::get_slots(hh, seg) + group + impl::lowest_bit(m);
+                        impl::prefetch(candidate);
+                    }
+                }
+            }
+
+            // A concurrent writer may be moving the slots: values are only prefetched by plain lookups.
+            // The slot matched above is only checked against the full hash, f() compares the key once.
+            if constexpr(SPLIT_VALUE && !CONCURRENT) {
+                if(i >= 2 * D && i - (2 * D) < n) {
+                    size_t j = i - (2 * D);
+                    const kv_pair* candidate = candidates[j % (4 * D)];
+
+                    if(candidate && candidate->hash == hashes[j % (4 * D)] && candidate->value.spilled())
+                        impl::prefetch(m_value + candidate->value.extent.offset);
+                }
+            }
+
+            if(i >= 3 * D) {
+                size_t j = i - (3 * D);
+                f(hashes[j % (4 * D)], keys[j]);
+            }
         }
-        else
-            m_hash->valuecapacity = 0;
     }
 
-    iterator begin() const {
-        kv_pair* e = this->get_kvpairs();
-        kv_pair* ee = this->get_kvpairs() + m_hash->capacity;
-        while(e != ee && e->state != STATE_FULL) e++;
-        return iterator{this, e, ee};
-    }
+    slot_ref get_entry(const K& k) const { return this->find_entry(m_hash, m_hash->segmentcapacity, this->hash(k), k); }
+    slot_ref get_entry(size_t h, const K& k) const { return this->find_entry(m_hash, m_hash->segmentcapacity, h, k); }
 
-    iterator end() const {
-        kv_pair* e = this->get_kvpairs() + m_hash->capacity;
-        return iterator{this, e, e};
+    // Returns the slot holding 'k' or the one it would be inserted into, an empty ref if the segment is full.
+    // Bounded by 'segments', the capacity that locates the directory: a concurrent reader may be looking
+    // at a table that is being written.
+    slot_ref find_entry(const hash_header* hh, size_t segments, size_t h, const K& k) const {
+        size_t seg = Self::get_segment_index(hh, segments, h);
+        if(seg >= segments) return {};
+
+        unsigned char* ctrl = Self::get_control(hh, seg);
+        kv_pair* slots = Self::get_slots(hh, seg);
+        const unsigned char c = Self::control_hash(h);
+        unsigned char* tombstone = nullptr;
+        size_t group = Self::home_group(h, std::min<size_t>(Self::get_segment(hh, seg)->depth, MAX_DEPTH));
+
+        for(size_t i = 0; i < SEGMENT_GROUPS; ++i, group = (group + impl::GROUP_SIZE) & (SEGMENT_SLOTS - 1)) {
+            for(uint32_t m = impl::group_match(ctrl + group, c); m; m &= m - 1) {
+                size_t index = group + impl::lowest_bit(m);
+                if(this->key_equals(hh, slots[index], h, k)) return {ctrl + index, slots + index};
+            }
+
+            if(!tombstone) {
+                uint32_t t = impl::group_match(ctrl + group, CTRL_TOMBSTONE);
+                if(t) tombstone = ctrl + group + impl::lowest_bit(t);
+            }
+
+            uint32_t empty = impl::group_match(ctrl + group, CTRL_EMPTY);
+
+            if(empty) {
+                unsigned char* p = tombstone ? tombstone : ctrl + group + impl::lowest_bit(empty);
+                return {p, slots + (p - ctrl)};
+            }
+        }
+
+        if(!tombstone) return {};
+        return {tombstone, slots + (tombstone - ctrl)};
     }
 
-    float load_factor() { return static_cast<float>(m_hash->fill) / static_cast<float>(m_hash->capacity); }
-    size_t capacity() const { return m_hash->capacity; }
-    size_t size() const { return m_hash->size; }
-    bool empty() const { return m_hash->size == 0; }
+    // Runs 'f' until it observes a snapshot that no write has overlapped, 'f' returns false for torn reads
+    template<typename Function>
+    bool read_consistent(Function f) const {
+        for(;;) {
+            const hash_header* h = impl::atomic_load(m_hash);
+            size_t seq = impl::atomic_load(h->sequence);
+
+            if(seq & 1) {
+                impl::cpu_relax();
+                continue;
+            }
+
+            // The mapping is published before its capacity, reloading it proves 'h' covers 'segments'
+            size_t segments = impl::atomic_load(h->segmentcapacity);
+            if(impl::atomic_load(m_hash) != h) continue;
 
-    bool contains(K k) const {
-        const kv_pair& e = this->get_entry(k);
-        return e.state == STATE_FULL;
+            // Same for the value file: a capacity loaded before the mapping never exceeds it
+            size_t valuecapacity = impl::atomic_load(h->valuecapacity);
+            const char* values = impl::atomic_load(m_value);
+            bool ok = f(h, segments, values, valuecapacity);
+            impl::atomic_fence_acquire();
+            if(impl::atomic_load_relaxed(h->sequence) == seq) return ok;
+        }
     }
 
-    void clear() {
-        kv_pair* kv = this->get_kvpairs();
-        std::fill_n(reinterpret_cast<char*>(kv), m_hash->capacity * sizeof(kv_pair), 0);
-        m_hash->fill = m_hash->size = m_hash->valuesize = 0;
+    void retire(void* m, size_t size) {
+        if constexpr(CONCURRENT) m_retired.emplace_back(m, size);
+        else impl::munmap(m, size);
     }
 
-    void erase(K k) {
-        kv_pair& e = this->get_entry(k);
-        if(e.state != STATE_FULL) return;
-        --m_hash->size;
-        e.state = STATE_TOMBSTONE;
+    void reclaim() {
+        if constexpr(CONCURRENT) {
+            impl::atomic_fence();
+            if(m_retired.empty() || impl::atomic_load(m_readers)) return;
+
+            for(const auto& [m, size] : m_retired) impl::munmap(m, size);
+            m_retired.clear();
+        }
     }
 
-    void set(K k, const V& v) {
-        this->check_rehash();
+    // Doubles the segments the hash file can hold, segments are then appended without remapping
+    void extend_hash() {
+        assume(m_fhash != impl::INVALID_HANDLE);
+        event_timer t{this, EVENT_EXTEND_HASH};
+        size_t oldcapacity = m_hash->segmentcapacity;
+        size_t newcapacity = std::min(oldcapacity << 1, MAX_SEGMENTS);
+        assume(newcapacity > oldcapacity);
+        size_t oldsize = Self::hash_size(oldcapacity), newsize = Self::hash_size(newcapacity);
+        impl::resize(m_fhash, newsize);
 
-        kv_pair& e = this->get_entry(k);
-        e.key = k;
+        if constexpr(CONCURRENT) {
+            // Readers may still hold the old mapping: publish a new one before the new capacity
+            hash_header* newhash = impl::mmap<hash_header>(m_fhash, newsize, WAL);
+            assume(newhash);
+            if constexpr(WAL) std::copy_n(reinterpret_cast<const char*>(m_hash), oldsize, reinterpret_cast<char*>(newhash));
+            this->retire(m_hash, oldsize);
+            impl::atomic_store(m_hash, newhash);
+        }
+        else {
+            m_hash = impl::mremap(m_hash, oldsize, newsize, m_fhash, WAL);
+            assume(m_hash);
+        }
 
-        if(e.state != STATE_FULL) ++m_hash->size;
-        if(e.state == STATE_EMPTY) ++m_hash->fill;
+        // The directory moves past the new last segment, its old place is where the next segments get appended
+        const uint32_t* olddirectory = Self::get_directory(m_hash, oldcapacity);
+        std::copy_n(olddirectory, size_t{1} << m_hash->globaldepth, Self::get_directory(m_hash, newcapacity));
+        impl::atomic_store(m_hash->segmentcapacity, newcapacity);
+        std::fill_n(reinterpret_cast<char*>(Self::get_segment(m_hash, oldcapacity)), Self::directory_capacity(oldcapacity) * sizeof(uint32_t), 0);
+        this->apply_access();
+    }
 
-        if constexpr(SPLIT_VALUE) {
-            size_t n = 0;
-            m_wbuffer.clear();
+    void extend_value() {
+        assume(m_fvalue != impl::INVALID_HANDLE);
+        event_timer t{this, EVENT_EXTEND_VALUE};
+        size_t oldcapacity = m_hash->valuecapacity;
+        size_t newcapacity = oldcapacity << 1;
+        impl::resize(m_fvalue, newcapacity);
 
-            Serializer::serialize(v, [&](const void* data, size_t size) {
-                m_wbuffer.resize(m_wbuffer.size() + size);
-                std::copy_n(reinterpret_cast<const char*>(data), size, m_wbuffer.data() + n);
-                n += size;
-            });
+        // Regions double in size when the live counters run out, a compaction in progress starts over.
+        // A reclaimed region paired with a used one is only dead space until its pair is drained.
+        while(((newcapacity - 1) >> m_hash->regionbits) >= VALUE_REGIONS) {
+            auto live = [&](size_t r) { return m_hash->regionlive[r] == REGION_RECLAIMED ? 0 : m_hash->regionlive[r]; };
 
-            if(e.state == STATE_EMPTY || n > e.value.capacity) {
-                if(this->values_filled() > MAX_FILL_CAPACITY) this->extend_value();
-                e.value.capacity = n;
-                e.value.offset = impl::seek(m_fvalue, m_hash->valuesize);
-                m_hash->valuesize += n;
+            for(size_t i = 0; i < VALUE_REGIONS / 2; ++i) {
+                const bool reclaimed = m_hash->regionlive[2 * i] == REGION_RECLAIMED && m_hash->regionlive[(2 * i) + 1] == REGION_RECLAIMED;
+                m_hash->regionlive[i] = reclaimed ? REGION_RECLAIMED : live(2 * i) + live((2 * i) + 1);
             }
-            else
-                impl::seek(m_fvalue, e.value.offset);
 
-            impl::write(m_fvalue, m_wbuffer.data(), n);
+            std::fill_n(m_hash->regionlive + (VALUE_REGIONS / 2), VALUE_REGIONS / 2, 0);
+            ++m_hash->regionbits;
+            m_compaction = {};
+            m_reclaimed = this->count_reclaimed();
         }
-        else
-            e.value = v;
 
-        e.state = STATE_FULL;
+        if constexpr(CONCURRENT) {
+            // Readers may still hold the old mapping: publish a new one before the new capacity
+            char* newvalue = impl::mmap<char>(m_fvalue, newcapacity);
+            assume(newvalue);
+            this->retire(m_value, oldcapacity);
+            impl::atomic_store(m_value, newvalue);
+        }
+        else {
+            m_value = impl::mremap(m_value, oldcapacity, newcapacity, m_fvalue);
+            assume(m_value);
+        }
+
+        impl::atomic_store(m_hash->valuecapacity, newcapacity);
+        this->apply_access();
+    }
+
+    void extend_key() {
+        assume(m_fkey != impl::INVALID_HANDLE);
+        event_timer t{this, EVENT_EXTEND_KEY};
+        size_t oldcapacity = m_hash->keycapacity;
+        size_t newcapacity = oldcapacity << 1;
+        impl::resize(m_fkey, newcapacity);
+
+        if constexpr(CONCURRENT) {
+            char* newkey = impl::mmap<char>(m_fkey, newcapacity);
+            assume(newkey);
+            this->retire(m_key, oldcapacity);
+            impl::atomic_store(m_key, newkey);
+        }
+        else {
+            m_key = impl::mremap(m_key, oldcapacity, newcapacity, m_fkey);
+            assume(m_key);
+        }
+
+        impl::atomic_store(m_hash->keycapacity, newcapacity);
+        this->apply_access();
     }
 
-    void set(K k, V&& v) { this->set(k, std::move(v)); }
+    static uint64_t now() { return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()); }
+    static uint64_t expiry_after(std::chrono::seconds ttl) { return ttl.count() > 0 ? Self::now() + static_cast<uint64_t>(ttl.count()) : 0; }
 
-    bool get(K k, V& v) const {
-        if(this->empty()) return false;
-        const kv_pair& e = this->get_entry(k);
-        return this->get_value(e, v);
+    uint64_t default_expiry() const {
+        if constexpr(CACHE) return Self::expiry_after(m_ttl);
+        else return 0;
     }
 
-    std::optional<V> get(K k) const {
-        V v;
-        if(this->get(k, v)) return v;
-        return std::nullopt;
+    static bool expired([[maybe_unused]] const kv_pair& e, [[maybe_unused]] uint64_t now) {
+        if constexpr(CACHE) return e.expiry && e.expiry <= now;
+        else return false;
     }
 
-    void collect_garbage() {
-        if(this->empty()) return;
+    // A full slot that did not expire, cache mode also marks it referenced
+    bool hit([[maybe_unused]] const hash_header* hh, slot_ref s) const {
+        if(!s.full()) return false;
 
-        this->check_rehash();
+        if constexpr(CACHE) {
+            if(s.kv->expiry && s.kv->expiry <= Self::now()) return false;
+            this->reference(hh, s);
+        }
 
-        if constexpr(SPLIT_VALUE) {
-            std::string tmpvalue = m_fvaluepath + ".tmp";
-            impl::file_h newfile = impl::open(tmpvalue);
-            assume(newfile != impl::INVALID_HANDLE);
-            impl::resize(newfile, m_hash->valuecapacity);
+        return true;
+    }
+
+    // Reference bits are indexed by seg * SEGMENT_SLOTS + slot, 'hh' is the mapping 's' points into
+    void reference(const hash_header* hh, slot_ref s) const {
+        size_t offset = static_cast<size_t>(s.ctrl - Self::get_control(hh, 0));
+        size_t n = ((offset / SEGMENT_SIZE) * SEGMENT_SLOTS) + (offset % SEGMENT_SIZE);
+        uint64_t bit = uint64_t{1} << (n % 64);
+        if(!(impl::atomic_load_relaxed(m_referenced[n / 64]) & bit)) impl::atomic_or_relaxed(m_referenced[n / 64], bit);
+    }
 
-            kv_pair* e = this->get_kvpairs();
-            impl::file_o offset = 0;
+    void init_cache_mode() {
+        m_referenced = impl::mmap_anonymous<uint64_t>(REFERENCED_SIZE);
+        assume(m_referenced);
+        m_wheel.assign(WHEEL_SLOTS, {});
+        m_wheeltick = Self::now();
+        m_wheelcursor = 0;
+        for(size_t seg = 0; seg < m_hash->segments; ++seg) this->schedule(seg, m_wheeltick);
+    }
+
+    void schedule(size_t seg, uint64_t expiry) {
+        std::vector<uint64_t>& bucket = m_wheel[expiry % WHEEL_SLOTS];
+        if(bucket.size() <= seg / 64) bucket.resize((seg / 64) + 1);
+        bucket[seg / 64] |= uint64_t{1} << (seg % 64);
+    }
 
-            for(size_t i = 0; i < m_hash->capacity; ++i, ++e) {
-                if(e->state != STATE_FULL) continue;
+    // Half of the entries of 'seg' move to 'newseg': it is due whenever 'seg' is
+    void schedule_split(size_t seg, size_t newseg) {
+        for(size_t b = 0; b < WHEEL_SLOTS; ++b) {
+            const std::vector<uint64_t>& bucket = m_wheel[b];
+            if(seg / 64 < bucket.size() && (bucket[seg / 64] & (uint64_t{1} << (seg % 64)))) this->schedule(newseg, b);
+        }
+    }
 
-                if(m_wbuffer.size() < e->value.capacity)
-                    m_wbuffer.resize(e->value.capacity);
+    // Removes the expired entries of 'seg' and puts it back on the wheel for the others
+    size_t sweep_segment(size_t seg, uint64_t now) {
+        writer_guard g{this};
+        unsigned char* ctrl = Self::get_control(m_hash, seg);
+        kv_pair* e = Self::get_slots(m_hash, seg);
+        size_t removed = 0;
 
-                impl::seek(m_fvalue, e->value.offset);
-                impl::read(m_fvalue, m_wbuffer.data(), e->value.capacity);
-                e->value.offset = offset;
+        for(size_t i = 0; i < SEGMENT_SLOTS; ++i) {
+            if(!(ctrl[i] & CTRL_FULL) || !e[i].expiry) continue;
 
-                impl::write(newfile, m_wbuffer.data(), e->value.capacity);
-                offset += e->value.capacity;
+            if(e[i].expiry <= now) {
+                this->remove_slot(seg, {ctrl + i, e + i});
+                ++removed;
             }
+            else
+                this->schedule(seg, e[i].expiry);
+        }
+
+        return removed;
+    }
+
+    size_t live_bytes() const {
+        size_t bytes = m_hash->size * (1 + sizeof(kv_pair));
+        if constexpr(SPLIT_VALUE) bytes += m_hash->valuesize - m_hash->valuefree;
+        if constexpr(STRING_KEY) bytes += m_hash->keysize - m_hash->keyfree;
+        return bytes;
+    }
 
-            m_hash->valuesize = offset;
-            impl::close(newfile);
+    // CLOCK: the hand takes expired entries and those not referenced since its last pass, others lose their bit
+    void enforce_limits() {
+        const uint64_t now = Self::now();
 
-            // Close and delete the old file, rename the new one
-            impl::close(m_fvalue);
-            std::remove(m_fvaluepath.c_str());
-            std::rename(tmpvalue.c_str(), m_fvaluepath.c_str());
-            this->reinit_valuefile(m_hash->valuecapacity);
+        while(m_hash->size && ((m_maxitems && m_hash->size > m_maxitems) || (m_maxbytes && this->live_bytes() > m_maxbytes))) {
+            if(m_evicthand >= m_hash->segments * SEGMENT_SLOTS) m_evicthand = 0;
+            size_t n = m_evicthand++;
+            size_t seg = n / SEGMENT_SLOTS;
+            unsigned char* ctrl = Self::get_control(m_hash, seg) + (n % SEGMENT_SLOTS);
+            if(!(*ctrl & CTRL_FULL)) continue;
+
+            kv_pair* e = Self::get_slots(m_hash, seg) + (n % SEGMENT_SLOTS);
+            uint64_t bit = uint64_t{1} << (n % 64);
+
+            if(!Self::expired(*e, now) && (impl::atomic_load_relaxed(m_referenced[n / 64]) & bit)) {
+                impl::atomic_and_relaxed(m_referenced[n / 64], ~bit);
+                continue;
+            }
+
+            this->remove_slot(seg, {ctrl, e});
         }
     }
 
-    void rehash() {
-        assume(!m_fhashpath.empty());
-        assume(m_fhash != impl::INVALID_HANDLE);
-        assume(m_hash);
+    // Finds the value of 's' in the cache or deserializes it there, evicting until it fits the budget
+    const V& cached_value(slot_ref s) const {
+        size_t slot = static_cast<size_t>(s.ctrl - Self::get_control(m_hash, 0));
+        auto it = m_cacheindex.find(slot);
 
-        size_t newcapacity = m_hash->capacity << 1;
-        size_t newsize = sizeof(hash_header) + (newcapacity * sizeof(kv_pair));
-        std::string tmphash = m_fhashpath + ".tmp";
-        impl::file_h newfile = impl::open(tmphash);
-        assume(newfile != impl::INVALID_HANDLE);
-        impl::resize(newfile, newsize);
+        if(it != m_cacheindex.end()) {
+            cache_entry& ce = m_cache[it->second];
+            ce.referenced = true;
+            return ce.value;
+        }
 
-        hash_header* newhash = impl::mmap<hash_header>(newfile, newsize);
-        *newhash = *m_hash;
-        newhash->capacity = newcapacity;
-        newhash->fill = newhash->size; // Reset tombstones count
+        const split_value& sv = s.kv->value;
+        size_t bytes = sizeof(cache_entry) + (sv.spilled() ? sv.extent.capacity : sv.size);
+
+        if(bytes > m_cachebudget) {
+            this->get_value(*s.kv, m_uncached);
+            return m_uncached;
+        }
 
-        kv_pair* newpair = reinterpret_cast<kv_pair*>(newhash + 1);
-        kv_pair* oldpair = this->get_kvpairs();
+        while(m_cachebytes + bytes > m_cachebudget) this->evict_cache();
 
-        for(size_t i = 0; i < m_hash->capacity; ++i, ++oldpair) {
-            if(oldpair->state != STATE_FULL) continue;
+        size_t i = m_cache.size();
 
-            size_t idx = this->hash(oldpair->key) % newhash->capacity;
-            newpair[idx] = *oldpair;
+        if(m_cachefree.empty()) m_cache.emplace_back();
+        else {
+            i = m_cachefree.back();
+            m_cachefree.pop_back();
         }
 
-        impl::munmap(newhash, newsize);
-        impl::close(newfile);
+        cache_entry& ce = m_cache[i];
+        ce.slot = slot;
+        ce.bytes = bytes;
+        ce.referenced = false;
+        this->get_value(*s.kv, ce.value);
+        m_cacheindex.emplace(slot, i);
+        m_cachebytes += bytes;
+        return ce.value;
+    }
 
-        // Unmap, close and delete the old file, rename the new one
-        size_t oldsize = sizeof(hash_header) + (m_hash->capacity * sizeof(kv_pair));
-        impl::munmap(m_hash, oldsize);
-        impl::close(m_fhash);
-        std::remove(m_fhashpath.c_str());
-        std::rename(tmphash.c_str(), m_fhashpath.c_str());
-        this->reinit_hashfile(newcapacity);
+    // CLOCK: the hand clears referenced bits until it finds an entry that was not used since its last pass
+    void evict_cache() const {
+        for(;;) {
+            if(m_cachehand >= m_cache.size()) m_cachehand = 0;
+            size_t i = m_cachehand++;
+            cache_entry& ce = m_cache[i];
+
+            if(ce.slot == NO_SLOT) continue;
+
+            if(ce.referenced) ce.referenced = false;
+            else {
+                this->drop_cache(i);
+                return;
+            }
+        }
     }
 
-    static Self load(const std::string& name, std::string basepath = std::string{}) {
-        assume(!name.empty());
-        if(!basepath.empty()) basepath.append(impl::PATH_SEPARATOR);
+    void drop_cache(size_t i) const {
+        cache_entry& ce = m_cache[i];
+        m_cacheindex.erase(ce.slot);
+        m_cachebytes -= ce.bytes;
+        ce.slot = NO_SLOT;
+        ce.value = V{};
+        m_cachefree.push_back(i);
+    }
 
-        std::string hashpath = basepath + name + impl::HASH_SUFFIX;
-        if(!impl::is_file(hashpath)) except("Hash file '{}' not found", hashpath);
-        return Self{impl::open(hashpath), name, basepath};
+    void uncache(slot_ref s) {
+        if(m_cacheindex.empty()) return;
+
+        auto it = m_cacheindex.find(static_cast<size_t>(s.ctrl - Self::get_control(m_hash, 0)));
+        if(it != m_cacheindex.end()) this->drop_cache(it->second);
     }
 
-private:
-    HashDB(impl::file_h fhash, [[maybe_unused]] const std::string& name, [[maybe_unused]] const std::string basepath): m_fhash{fhash} {
-        assume(m_fhash != impl::INVALID_HANDLE);
-        m_fhashpath = basepath + impl::HASH_SUFFIX;
+    void clear_cache() {
+        m_cache.clear();
+        m_cachefree.clear();
+        m_cacheindex.clear();
+        m_cachehand = m_cachebytes = 0;
+    }
 
-        size_t size = impl::size(fhash);
-        m_hash = impl::mmap<hash_header>(m_fhash, size);
-        assume(m_hash);
+    static size_t bloom_size(size_t blocks) { return sizeof(bloom_header) + (blocks * sizeof(bloom_block)); }
 
-        if(m_hash->integersize != sizeof(size_t)) except("Unexpected integer size");
-        if(m_hash->signature != SIGNATURE) except("Invalid signature");
+    // 'h' is remixed so that the filter does not reuse the bits picking the segment and the control byte:
+    // the high half picks the block, word i gets bit (lo32 * BLOOM_SALT[i]) >> 26
+    static bloom_block* bloom_block_of(const bloom_header* b, uint64_t g) { return reinterpret_cast<bloom_block*>(const_cast<bloom_header*>(b) + 1) + impl::mulhi(g, b->blocks); }
+    static uint64_t bloom_bit(uint64_t g, size_t i) { return uint64_t{1} << ((static_cast<uint32_t>(g) * BLOOM_SALT[i]) >> 26); }
 
-        if constexpr(SPLIT_VALUE) {
-            m_fvaluepath = basepath + name + impl::VALUE_SUFFIX;
-            if(!impl::is_file(m_fvaluepath)) except("Value file '{}' not found", m_fvaluepath);
-            m_fvalue = impl::open(m_fvaluepath);
-            assume(m_fvalue != impl::INVALID_HANDLE);
-        }
+    static void bloom_add(bloom_header* b, size_t h) {
+        uint64_t g = impl::mix64(h);
+        bloom_block* block = Self::bloom_block_of(b, g);
+
+        for(size_t i = 0; i < BLOOM_WORDS; ++i)
+            impl::atomic_store_relaxed(block->words[i], block->words[i] | Self::bloom_bit(g, i));
     }
 
-    kv_pair* get_kvpairs() const { return reinterpret_cast<kv_pair*>(m_hash + 1); }
-    float values_filled() { return static_cast<float>(m_hash->valuesize) / static_cast<float>(m_hash->valuecapacity); }
+    // True when the filter proves that no key hashes to 'h'
+    bool bloom_rejects(size_t h) const { return Self::bloom_rejects(impl::atomic_load(m_bloom), h); }
 
-    bool get_value(const kv_pair& e, V& v) const {
-        if(e.state != STATE_FULL) return false;
+    // Same against a filter the caller loaded once: a rebuild publishes a new one, retired like the other mappings
+    static bool bloom_rejects([[maybe_unused]] const bloom_header* b, [[maybe_unused]] size_t h) {
+        if constexpr(BLOOM) {
+            uint64_t g = impl::mix64(h);
+            const bloom_block* block = Self::bloom_block_of(b, g);
+            uint64_t missing = 0;
 
-        if constexpr(SPLIT_VALUE) {
-            impl::seek(m_fvalue, e.value.offset);
+            for(size_t i = 0; i < BLOOM_WORDS; ++i)
+                missing |= Self::bloom_bit(g, i) & ~impl::atomic_load_relaxed(block->words[i]);
 
-            Serializer::deserialize(v, [&](void* data, size_t size) {
-                impl::read(m_fvalue, data, size);
-            });
+            return missing != 0;
         }
         else
-            v = e.value;
-
-        return true;
+            return false;
     }
 
-    size_t hash(K k) const {
-        if constexpr(std::is_integral_v<K>) return k;
-        else if constexpr(std::is_floating_point_v<K> || std::is_same_v<K, std::string>) return impl::fnv1a(k);
-        else static_assert(impl::always_false_v<K>);
+    void mark_bloom(bool dirty) {
+        m_bloom->dirty = dirty;
+        impl::msync(m_bloom, sizeof(bloom_header));
     }
 
-    const kv_pair& get_entry(K k) const { return const_cast<Self*>(this)->get_entry(k); }
+    // Keeps the filter on disk if it was closed cleanly and matches its size, rebuilds it otherwise
+    void load_bloom() {
+        if(impl::is_file(m_fbloompath)) {
+            m_fbloom = impl::open(m_fbloompath);
+            assume(m_fbloom != impl::INVALID_HANDLE);
+            size_t size = impl::size(m_fbloom);
+
+            if(size >= sizeof(bloom_header)) {
+                m_bloom = impl::mmap<bloom_header>(m_fbloom, size);
+                assume(m_bloom);
 
-    kv_pair& get_entry(K k) {
-        kv_pair* h = this->get_kvpairs();
+                if(m_bloom->signature == BLOOM_SIGNATURE && !m_bloom->dirty && size == Self::bloom_size(m_bloom->blocks) && m_hash->size <= m_bloom->capacity) {
+                    // Small next to the slots and hit everywhere by the first lookups: read it in one go
+                    impl::will_need(m_bloom, size);
+                    this->mark_bloom(true);
+                    return;
+                }
+
+                impl::munmap(m_bloom, size);
+                m_bloom = nullptr;
+            }
 
-        for(size_t index = this->hash(k) % m_hash->capacity; ; index = (index + 1) % m_hash->capacity) {
-            if(h[index].state != STATE_FULL || h[index].key == k)
-                return h[index];
+            impl::close(m_fbloom);
+            m_fbloom = impl::INVALID_HANDLE;
         }
 
-        unreachable;
+        this->rebuild_bloom();
     }
 
-    void extend_value() {
-        assume(m_fvalue != impl::INVALID_HANDLE);
-        m_hash->valuecapacity <<= 1;
-        impl::resize(m_fvalue, m_hash->valuecapacity);
+    // Writes a filter sized for twice the current entries aside, fills it from the slot hashes and publishes it
+    void rebuild_bloom() {
+        size_t capacity = std::max<size_t>(m_hash->size * 2, DEFAULT_ITEMS_COUNT);
+        size_t blocks = ((capacity * BLOOM_BITS_PER_KEY) + (sizeof(bloom_block) * 8) - 1) / (sizeof(bloom_block) * 8);
+        size_t size = Self::bloom_size(blocks);
+        std::string tmppath = m_fbloompath + impl::TMP_SUFFIX;
+
+        impl::file_h newfile = impl::open(tmppath);
+        assume(newfile != impl::INVALID_HANDLE);
+        impl::resize(newfile, 0);
+        impl::resize(newfile, size);
+        bloom_header* newbloom = impl::mmap<bloom_header>(newfile, size);
+        assume(newbloom);
+
+        newbloom->signature = BLOOM_SIGNATURE;
+        newbloom->blocks = blocks;
+        newbloom->capacity = capacity;
+        newbloom->dirty = true;
+        this->for_each_entry([&](const kv_pair& e) { Self::bloom_add(newbloom, e.hash); });
+        impl::rename(tmppath, m_fbloompath);
+
+        if(m_fbloom != impl::INVALID_HANDLE) impl::close(m_fbloom);
+        m_fbloom = newfile;
+        if(m_bloom) this->retire(m_bloom, Self::bloom_size(m_bloom->blocks));
+        impl::atomic_store(m_bloom, newbloom);
+        this->apply_access();
     }
 
-    void check_rehash() {
-        if(this->load_factor() > MAX_FILL_CAPACITY)
-            this->rehash();
+    // Advises every mapping with the access profile, a new mapping starts from the kernel's default
+    void apply_access() const {
+        if(!m_hash) return;
+
+        auto advise = [&](void* m, size_t size) {
+            if(m_access & hashdb_access_random) impl::advise(m, size, impl::advice::random);
+            else if(m_access & hashdb_access_sequential) impl::advise(m, size, impl::advice::sequential);
+            else impl::advise(m, size, impl::advice::normal);
+
+            if(m_access & hashdb_access_willneed) impl::will_need(m, size);
+        };
+
+        const size_t hashsize = Self::hash_size(m_hash->segmentcapacity);
+        advise(m_hash, hashsize);
+        if(m_access & hashdb_access_hugepages) impl::huge_pages(m_hash, hashsize);
+
+        if(m_value) advise(m_value, m_hash->valuecapacity);
+        if(m_key) advise(m_key, m_hash->keycapacity);
+        if(m_bloom) advise(m_bloom, Self::bloom_size(m_bloom->blocks));
     }
 
-    void reinit_hashfile(size_t capacity = DEFAULT_ITEMS_COUNT, bool init = false) {
+    void reinit_hashfile() {
         assume(!m_fhashpath.empty());
-        size_t size = sizeof(hash_header) + (capacity * sizeof(kv_pair));
+        size_t size = Self::hash_size(1);
 
         m_fhash = impl::open(m_fhashpath);
         assume(m_fhash != impl::INVALID_HANDLE);
 
+        // Truncating first leaves a sparse, zeroed file: segments are only paged in once used
+        impl::resize(m_fhash, 0);
         impl::resize(m_fhash, size);
-        m_hash = impl::mmap<hash_header>(m_fhash, size);
-        if(init) std::fill_n(reinterpret_cast<char*>(m_hash), size, 0);
+        m_hash = impl::mmap<hash_header>(m_fhash, size, WAL);
         assume(m_hash);
     }
 
@@ -609,13 +4767,400 @@ private:
         m_fvalue = impl::open(m_fvaluepath);
         assume(m_fvalue != impl::INVALID_HANDLE);
         impl::resize(m_fvalue, capacity);
+        m_value = impl::mmap<char>(m_fvalue, capacity);
+        assume(m_value);
+    }
+
+    void reinit_keyfile(size_t capacity) {
+        assume(!m_fkeypath.empty());
+        m_fkey = impl::open(m_fkeypath);
+        assume(m_fkey != impl::INVALID_HANDLE);
+        impl::resize(m_fkey, capacity);
+        m_key = impl::mmap<char>(m_fkey, capacity);
+        assume(m_key);
     }
 
 private:
     std::string m_fhashpath;
     std::string m_fvaluepath;
+    std::string m_fkeypath;
+    std::string m_fwalpath;
+    std::string m_fbloompath;
     std::string m_wbuffer;
+    std::string m_walbuffer;
+    std::string m_pbuffer;
+    std::vector<size_t> m_wsizes;
+    std::vector<uint32_t> m_dictindex;
+    std::vector<kv_pair> m_segment;
+    std::vector<unsigned char> m_segmentctrl;
+    std::unordered_map<K, std::optional<V>> m_pending;
+    std::unordered_map<K, uint64_t> m_pendingexpiry;
+    size_t m_groupcommit{DEFAULT_GROUP_COMMIT};
+    size_t m_checkpointsize{WAL_CHECKPOINT_SIZE};
+    size_t m_wrecords{0};
+    size_t m_walsize{0};
+    unsigned char m_walop{0};
+    bool m_hashdirty{false};
     impl::file_h m_fhash{impl::INVALID_HANDLE};
     impl::file_h m_fvalue{impl::INVALID_HANDLE};
+    impl::file_h m_fkey{impl::INVALID_HANDLE};
+    impl::file_h m_fwal{impl::INVALID_HANDLE};
+    impl::file_h m_fbloom{impl::INVALID_HANDLE};
     hash_header* m_hash{nullptr};
+    char* m_value{nullptr};
+    char* m_key{nullptr};
+    bloom_header* m_bloom{nullptr};
+    size_t m_cachebudget{0};
+    mutable std::deque<cache_entry> m_cache; // Growing it leaves the values handed out in place
+    mutable std::vector<size_t> m_cachefree;
+    mutable std::unordered_map<size_t, size_t> m_cacheindex;
+    mutable size_t m_cachehand{0};
+    mutable size_t m_cachebytes{0};
+    mutable V m_uncached{};
+    size_t m_iodepth{0};
+    mutable impl::io_ring m_ring;
+    mutable std::vector<async_read> m_reads;
+    mutable std::vector<size_t> m_readfree;
+    mutable size_t m_inflight{0};
+    uint64_t* m_referenced{nullptr};
+    std::vector<std::vector<uint64_t>> m_wheel;
+    uint64_t m_wheeltick{0};
+    size_t m_wheelcursor{0};
+    size_t m_evicthand{0};
+    std::chrono::seconds m_ttl{0};
+    size_t m_maxitems{0};
+    size_t m_maxbytes{0};
+    size_t m_access{hashdb_access_default};
+    compaction m_compaction;
+    size_t m_compactbudget{0};
+    size_t m_compactfreed{std::numeric_limits<size_t>::max() / 2};
+    size_t m_reclaimed{0}; // Regions marked REGION_RECLAIMED
+    std::vector<std::pair<void*, size_t>> m_retired;
+    mutable size_t m_readers{0};
+    std::array<hashdb_timing, EVENTS> m_events{};
+    mutable std::array<latency_counter, LATENCIES> m_latency{};
+};
+
+// Immutable table written by HashDB::freeze(): a minimal perfect hash (PTHash-like 'hash and displace')
+// places each key at its own record, lookups read one pilot and one record, opening only maps the file.
+// Layout: header, pilots (one per bucket), remap, records, data.
+// - Keys are spread over 'buckets' of about BUCKET_SIZE keys, each bucket has a pilot choosing
+//   positions in [0, positions) that no other key uses. positions = size + 1%, positions past 'size'
+//   are remapped to the free records below it, so records are dense.
+// - Trivially copyable keys and values are records themselves. Otherwise a record holds the offset of
+//   the serialized value (after the serialized key for std::string keys) in the data section, with the key
+//   itself when it is trivially copyable or its hash.
+template<typename K, typename V, typename Serializer = impl::Serializer, typename Hasher = impl::Hasher>
+class FrozenHashDB
+{
+    using Self = FrozenHashDB<K, V, Serializer, Hasher>;
+
+    template<typename, typename, size_t, typename, typename, size_t> friend class HashDB;
+
+    static constexpr bool KEY_RECORD = !std::is_same_v<K, std::string> && std::is_trivially_copyable_v<K>;
+    static constexpr bool FIXED_RECORD = KEY_RECORD && std::is_trivially_copyable_v<V>;
+    static constexpr size_t SIGNATURE = 0x5d1b023a;
+    static constexpr size_t VERSION = 1;
+    static constexpr size_t BUCKET_SIZE = 4;
+    static constexpr uint64_t MAX_PILOT = uint64_t{1} << 20;
+    static constexpr size_t WRITE_BUFFER = 1 << 20;
+
+    struct frozen_header {
+        size_t signature;
+        size_t version;
+        size_t integersize;
+        size_t recordsize;
+        size_t size;
+        size_t positions;
+        size_t buckets;
+        size_t seed;
+        size_t datasize;
+    };
+
+    struct fixed_record {
+        K key;
+        V value;
+    };
+
+    struct packed_record {
+        std::conditional_t<KEY_RECORD, K, uint64_t> key;
+        uint64_t offset;
+    };
+
+    using record = std::conditional_t<FIXED_RECORD, fixed_record, packed_record>;
+    static_assert(alignof(record) <= sizeof(size_t));
+
+public:
+    FrozenHashDB() = default;
+    explicit FrozenHashDB(const std::string& path) { this->open(path); }
+    ~FrozenHashDB() { this->close(); }
+
+    void open(const std::string& path) {
+        this->close();
+        if(!impl::is_file(path)) except("Frozen file '{}' not found", path);
+
+        m_fdata = impl::open(path);
+        assume(m_fdata != impl::INVALID_HANDLE);
+        m_size = impl::size(m_fdata);
+        if(m_size < sizeof(frozen_header)) except("Invalid frozen file");
+
+        m_header = impl::mmap<frozen_header>(m_fdata, m_size, true);
+        assume(m_header);
+
+        if(m_header->integersize != sizeof(size_t)) except("Unexpected integer size");
+        if(m_header->signature != SIGNATURE) except("Invalid signature");
+        if(m_header->version != VERSION) except("Unsupported version {}", m_header->version);
+        if(m_header->recordsize != sizeof(record)) except("Record size mismatch");
+        if(m_size != Self::data_offset(m_header->size, m_header->positions, m_header->buckets) + m_header->datasize) except("Invalid frozen file size");
+
+        const char* base = reinterpret_cast<const char*>(m_header);
+        m_pilots = reinterpret_cast<const uint32_t*>(base + sizeof(frozen_header));
+        m_remap = reinterpret_cast<const uint64_t*>(base + Self::remap_offset(m_header->buckets));
+        m_records = reinterpret_cast<const record*>(base + Self::records_offset(m_header->size, m_header->positions, m_header->buckets));
+        m_data = base + Self::data_offset(m_header->size, m_header->positions, m_header->buckets);
+    }
+
+    void close() {
+        if(m_header) impl::munmap(m_header, m_size);
+        if(m_fdata != impl::INVALID_HANDLE) impl::close(m_fdata);
+
+        m_header = nullptr;
+        m_fdata = impl::INVALID_HANDLE;
+        m_size = 0;
+    }
+
+    bool is_open() const { return m_header != nullptr; }
+    size_t size() const { return m_header->size; }
+    bool empty() const { return m_header->size == 0; }
+
+    bool contains(const K& k) const {
+        size_t keysize;
+        return this->find(k, keysize) != nullptr;
+    }
+
+    bool get(const K& k, V& v) const {
+        size_t keysize;
+        const record* r = this->find(k, keysize);
+        if(!r) return false;
+
+        if constexpr(FIXED_RECORD)
+            v = r->value;
+        else {
+            const char* p = m_data + r->offset + keysize;
+
+            Serializer::deserialize(v, [&](void* data, size_t size) {
+                std::copy_n(p, size, reinterpret_cast<char*>(data));
+                p += size;
+            });
+        }
+
+        return true;
+    }
+
+    std::optional<V> get(const K& k) const {
+        V v;
+        if(this->get(k, v)) return v;
+        return std::nullopt;
+    }
+
+private:
+    static size_t align(size_t n) { return (n + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1); }
+    static size_t remap_offset(size_t buckets) { return sizeof(frozen_header) + Self::align(buckets * sizeof(uint32_t)); }
+    static size_t records_offset(size_t size, size_t positions, size_t buckets) { return Self::remap_offset(buckets) + ((positions - size) * sizeof(uint64_t)); }
+    static size_t data_offset(size_t size, size_t positions, size_t buckets) { return Self::records_offset(size, positions, buckets) + (size * sizeof(record)); }
+
+    static size_t bucket_of(uint64_t h, uint64_t seed, size_t buckets) { return impl::mulhi(impl::mix64(h ^ seed), buckets); }
+    static size_t position_of(uint64_t h, uint64_t pilothash, size_t positions) { return impl::mulhi(impl::mix64(h ^ pilothash), positions); }
+    static uint64_t pilot_hash(uint64_t seed, uint64_t pilot) { return impl::mix64(seed + pilot); }
+
+    // The only record 'k' can be in, if it is in the table at all. 'keysize' receives its serialized size.
+    const record* find(const K& k, [[maybe_unused]] size_t& keysize) const {
+        if(!m_header->size) return nullptr;
+
+        const frozen_header* hh = m_header;
+        uint64_t h = Hasher::hash(k);
+        uint64_t pilot = m_pilots[Self::bucket_of(h, hh->seed, hh->buckets)];
+        size_t pos = Self::position_of(h, Self::pilot_hash(hh->seed, pilot), hh->positions);
+        if(pos >= hh->size) pos = m_remap[pos - hh->size];
+
+        const record* r = m_records + pos;
+
+        if constexpr(KEY_RECORD) {
+            keysize = 0;
+            return r->key == k ? r : nullptr;
+        }
+        else {
+            if(r->key != h) return nullptr;
+
+            // Serialized keys are compared byte by byte, get() reads the value right after them
+            thread_local std::string kbuffer;
+            kbuffer.clear();
+            Serializer::serialize(k, [&](const void* data, size_t size) { kbuffer.append(reinterpret_cast<const char*>(data), size); });
+
+            keysize = kbuffer.size();
+            if(keysize > hh->datasize || r->offset > hh->datasize - keysize) return nullptr;
+            return std::equal(kbuffer.begin(), kbuffer.end(), m_data + r->offset) ? r : nullptr;
+        }
+    }
+
+    // Finds a seed and a pilot per bucket that send every hash to its own position, fills 'slots' with
+    // the final (remapped) record of each hash. Pilots are searched from the largest bucket down.
+    static uint64_t build(const std::vector<uint64_t>& hashes, size_t positions, size_t buckets,
+                          std::vector<uint32_t>& pilots, std::vector<uint64_t>& remap, std::vector<uint64_t>& slots) {
+        const size_t n = hashes.size();
+        std::vector<size_t> start(buckets + 1), order(n), bybucket;
+        std::vector<bool> taken(positions);
+        std::vector<size_t> candidates;
+
+        for(uint64_t seed = 0; ; ++seed) {
+            // Counting sort of the keys by bucket
+            std::fill(start.begin(), start.end(), 0);
+            for(uint64_t h : hashes) ++start[Self::bucket_of(h, seed, buckets) + 1];
+            for(size_t b = 0; b < buckets; ++b) start[b + 1] += start[b];
+
+            std::vector<size_t> fill(start.begin(), start.end() - 1);
+            for(size_t i = 0; i < n; ++i) order[fill[Self::bucket_of(hashes[i], seed, buckets)]++] = i;
+
+            size_t maxsize = 0;
+
+            for(size_t b = 0; b < buckets; ++b) {
+                maxsize = std::max(maxsize, start[b + 1] - start[b]);
+
+                for(size_t i = start[b]; i < start[b + 1]; ++i) {
+                    for(size_t j = start[b]; j < i; ++j)
+                        if(hashes[order[i]] == hashes[order[j]]) except("Two keys share the same hash, they cannot be frozen");
+                }
+            }
+
+            // Buckets by decreasing size
+            bybucket.clear();
+
+            for(size_t sz = maxsize; sz > 0; --sz) {
+                for(size_t b = 0; b < buckets; ++b)
+                    if(start[b + 1] - start[b] == sz) bybucket.push_back(b);
+            }
+
+            std::fill(taken.begin(), taken.end(), false);
+            std::fill(pilots.begin(), pilots.end(), 0);
+            bool ok = true;
+
+            for(size_t b : bybucket) {
+                uint64_t pilot = 0;
+
+                for( ; pilot < MAX_PILOT; ++pilot) {
+                    uint64_t ph = Self::pilot_hash(seed, pilot);
+                    candidates.clear();
+
+                    for(size_t i = start[b]; i < start[b + 1]; ++i) {
+                        size_t pos = Self::position_of(hashes[order[i]], ph, positions);
+                        if(taken[pos] || std::find(candidates.begin(), candidates.end(), pos) != candidates.end()) break;
+                        candidates.push_back(pos);
+                    }
+
+                    if(candidates.size() == start[b + 1] - start[b]) break;
+                }
+
+                if(pilot == MAX_PILOT) {
+                    ok = false;
+                    break;
+                }
+
+                pilots[b] = static_cast<uint32_t>(pilot);
+
+                for(size_t i = start[b], j = 0; i < start[b + 1]; ++i, ++j) {
+                    taken[candidates[j]] = true;
+                    slots[order[i]] = candidates[j];
+                }
+            }
+
+            if(!ok) continue;
+
+            // Positions past 'n' are sent to the records left free below it
+            for(size_t pos = 0, free = 0; pos < positions - n; ++pos) {
+                if(!taken[n + pos]) continue;
+                while(taken[free]) ++free;
+                remap[pos] = free;
+                taken[free] = true;
+            }
+
+            for(uint64_t& s : slots)
+                if(s >= n) s = remap[s - n];
+
+            return seed;
+        }
+    }
+
+    // each(f) calls f(key, value) for every entry, in the order of 'hashes'
+    template<typename Each>
+    static void write(const std::string& path, const std::vector<uint64_t>& hashes, Each each) {
+        const size_t n = hashes.size();
+        const size_t positions = n + (n / 100) + (n ? 1 : 0);
+        const size_t buckets = std::max<size_t>(n / BUCKET_SIZE, 1);
+
+        std::vector<uint32_t> pilots(buckets);
+        std::vector<uint64_t> remap(positions - n), slots(n);
+        frozen_header header{SIGNATURE, VERSION, sizeof(size_t), sizeof(record), n, positions, buckets, 0, 0};
+        header.seed = Self::build(hashes, positions, buckets, pilots, remap, slots);
+
+        std::string tmppath = path + impl::TMP_SUFFIX;
+        impl::file_h h = impl::open(tmppath);
+        assume(h != impl::INVALID_HANDLE);
+        impl::resize(h, 0);
+
+        const size_t dataoffset = Self::data_offset(n, positions, buckets);
+        std::vector<record> records(n);
+        std::string buffer;
+        size_t i = 0;
+
+        each([&](const K& k, const V& v) {
+            if constexpr(FIXED_RECORD)
+                records[slots[i]] = {k, v};
+            else {
+                auto append = [&](const void* data, size_t size) { buffer.append(reinterpret_cast<const char*>(data), size); };
+
+                if constexpr(KEY_RECORD)
+                    records[slots[i]] = {k, header.datasize + buffer.size()};
+                else {
+                    records[slots[i]] = {hashes[i], header.datasize + buffer.size()};
+                    Serializer::serialize(k, append);
+                }
+
+                Serializer::serialize(v, append);
+
+                if(buffer.size() >= WRITE_BUFFER) {
+                    impl::pwrite(h, buffer.data(), buffer.size(), dataoffset + header.datasize);
+                    header.datasize += buffer.size();
+                    buffer.clear();
+                }
+            }
+
+            ++i;
+        });
+
+        assume(i == n);
+
+        if(!buffer.empty()) {
+            impl::pwrite(h, buffer.data(), buffer.size(), dataoffset + header.datasize);
+            header.datasize += buffer.size();
+        }
+
+        // The header goes last: a file is only valid once everything else is written
+        impl::resize(h, dataoffset + header.datasize);
+        impl::pwrite(h, pilots.data(), pilots.size() * sizeof(uint32_t), sizeof(frozen_header));
+        impl::pwrite(h, remap.data(), remap.size() * sizeof(uint64_t), Self::remap_offset(buckets));
+        impl::pwrite(h, records.data(), records.size() * sizeof(record), Self::records_offset(n, positions, buckets));
+        impl::pwrite(h, &header, sizeof(frozen_header), 0);
+        impl::sync(h);
+        impl::close(h);
+        impl::rename(tmppath, path);
+    }
+
+private:
+    impl::file_h m_fdata{impl::INVALID_HANDLE};
+    size_t m_size{0};
+    frozen_header* m_header{nullptr};
+    const uint32_t* m_pilots{nullptr};
+    const uint64_t* m_remap{nullptr};
+    const record* m_records{nullptr};
+    const char* m_data{nullptr};
 };
@@ -0,0 +1,521 @@
+// HashDB micro benchmarks, build with:
+//   g++ -std=c++17 -O2 -DNDEBUG hashdb_bench.cpp -lspdlog -lfmt -pthread -o hashdb_bench
+// Usage: hashdb_bench [items] [basepath]
+// Tables should be well past the last level cache to measure anything interesting.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "hashdb.h"
+
+namespace {
+
+constexpr size_t BATCH_SIZE = 256;
+constexpr size_t COMPACTION_BUDGET = 64 * 1024;
+constexpr size_t COMPACTION_ROUNDS = 4;
+
+// A value whose deserialization allocates a few times, what the value cache is for
+struct profile {
+    std::string name, email;
+    std::vector<std::string> tags;
+
+    template<typename Writer>
+    void serialize(Writer w) const {
+        size_t n = tags.size();
+        impl::Serializer::serialize(name, w);
+        impl::Serializer::serialize(email, w);
+        w(&n, sizeof(n));
+        for(const std::string& tag : tags) impl::Serializer::serialize(tag, w);
+    }
+
+    template<typename Reader>
+    void deserialize(Reader r) {
+        size_t n;
+        impl::Serializer::deserialize(name, r);
+        impl::Serializer::deserialize(email, r);
+        r(&n, sizeof(n));
+        tags.resize(n);
+        for(std::string& tag : tags) impl::Serializer::deserialize(tag, r);
+    }
+};
+
+// A JSON-like record, most of its bytes repeat across records
+std::string json_record(size_t i) {
+    std::string id = std::to_string(i);
+    return "{\"id\":" + id + ",\"name\":\"user number " + id + "\",\"email\":\"user." + id + "@example.com\",\"active\":" +
+           (i % 3 ? "true" : "false") + ",\"roles\":[\"reader\",\"writer\"],\"created\":\"2024-01-" + std::to_string(10 + (i % 18)) + "T12:00:00Z\"}";
+}
+
+template<typename Function>
+void measure(const char* name, size_t ops, Function f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::printf("%-32s %8.2f Mops/s\n", name, static_cast<double>(ops) / elapsed.count() / 1e6);
+}
+
+std::vector<int> random_keys(size_t n, size_t items, unsigned seed) {
+    std::mt19937 rng{seed};
+    std::vector<int> keys(n);
+    for(int& k : keys) k = static_cast<int>(rng() % (items * 2)); // Half of them are misses
+    return keys;
+}
+
+template<typename DB>
+void bench_lookups(const char* name, DB& db, size_t items) {
+    std::vector<int> keys = random_keys(BATCH_SIZE * 4096, items, 1);
+    size_t found = 0;
+
+    std::printf("%s\n", name);
+    for(int k : keys) found += db.get(k).has_value(); // Fault the mappings in first
+
+    measure("  get() loop", keys.size(), [&]() {
+        for(size_t i = 0; i < keys.size(); i += BATCH_SIZE) {
+            for(size_t j = i; j < i + BATCH_SIZE; ++j)
+                found += db.get(keys[j]).has_value();
+        }
+    });
+
+    measure("  multi_get()", keys.size(), [&]() {
+        for(size_t i = 0; i < keys.size(); i += BATCH_SIZE)
+            db.multi_get(keys.data() + i, BATCH_SIZE, [&](int, const auto& v) { found += v.has_value(); });
+    });
+
+    measure("  contains() loop", keys.size(), [&]() {
+        for(size_t i = 0; i < keys.size(); i += BATCH_SIZE) {
+            for(size_t j = i; j < i + BATCH_SIZE; ++j)
+                found += db.contains(keys[j]);
+        }
+    });
+
+    measure("  multi_contains()", keys.size(), [&]() {
+        for(size_t i = 0; i < keys.size(); i += BATCH_SIZE)
+            db.multi_contains(keys.data() + i, BATCH_SIZE, [&](int, bool f) { found += f; });
+    });
+
+    std::printf("  (%zu hits)\n", found);
+}
+
+// Drops 'files' from the page cache: the next lookups fault in every page they touch
+void evict(const std::vector<std::string>& files) {
+    for(const std::string& file : files) {
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if(fd == -1) continue;
+        ::fdatasync(fd);
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+}
+
+// Misses only, on a table loaded right after its files left the page cache
+template<typename DB>
+void bench_cold_misses(const char* name, const std::string& dbname, size_t items, const std::string& basepath, const std::vector<std::string>& files) {
+    std::vector<int> keys(BATCH_SIZE * 256);
+    for(size_t i = 0; i < keys.size(); ++i) keys[i] = static_cast<int>(items + ((i * 7919) % items));
+
+    evict(files);
+    DB db = DB::load(dbname, basepath);
+    size_t found = 0;
+
+    measure(name, keys.size(), [&]() {
+        for(int k : keys) found += db.contains(k);
+    });
+
+    if(found) std::printf("  (%zu unexpected hits)\n", found);
+}
+
+// Skewed reads: every lookup hits one of HOT_KEYS keys
+template<typename DB, typename Weight>
+void bench_hot(const char* name, DB& db, size_t items, Weight weight) {
+    constexpr size_t HOT_KEYS = 4096;
+    std::vector<int> keys = random_keys(BATCH_SIZE * 4096, HOT_KEYS / 2, 3);
+    for(int& k : keys) k = static_cast<int>((static_cast<size_t>(k) * 7919) % items);
+    const std::decay_t<decltype(*db.get(0))> missing{};
+    size_t total = 0;
+
+    std::printf("%s\n", name);
+
+    measure("  get() loop", keys.size(), [&]() {
+        for(int k : keys) total += weight(*db.get(k));
+    });
+
+    measure("  get_cached() loop", keys.size(), [&]() {
+        for(int k : keys) total += weight(db.get_cached(k, missing));
+    });
+
+    db.set_cache(HOT_KEYS * 1024);
+
+    measure("  get_cached() loop (cache)", keys.size(), [&]() {
+        for(int k : keys) total += weight(db.get_cached(k, missing));
+    });
+
+    db.set_cache(0);
+    std::printf("  (%zu total)\n", total);
+}
+
+// 'weight' turns a value into a number so that every scan has something to add up
+template<typename DB, typename Weight>
+void bench_scan(const char* name, const DB& db, Weight weight) {
+    size_t total = 0;
+
+    std::printf("%s\n", name);
+
+    measure("  iterator loop", db.size(), [&]() {
+        for(auto it = db.begin(); it != db.end(); ++it) total += weight(it.value());
+    });
+
+    measure("  reduce_parallel()", db.size(), [&]() {
+        total += db.reduce_parallel(size_t{0}, [&](size_t acc, const auto&, const auto& v) { return acc + weight(v); },
+                                    [](size_t a, size_t b) { return a + b; });
+    });
+
+    std::printf("  (%zu total)\n", total);
+}
+
+// An unbounded key stream into a table capped at 'limit' items, the footprint must stay put
+template<typename DB>
+void bench_cache(const char* name, size_t items, size_t limit, const std::string& basepath, const std::vector<std::string>& files) {
+    std::vector<int> keys = random_keys(BATCH_SIZE * 1024, limit / 2, 4);
+    size_t found = 0, disksize = 0;
+    DB db{"bench_cache", basepath};
+    db.set_limits(limit);
+
+    std::printf("%s\n", name);
+
+    measure("  set() stream", items * 4, [&]() {
+        for(size_t i = 0; i < items * 4; ++i) db.set(static_cast<int>(i), static_cast<long>(i));
+    });
+
+    measure("  contains() recent keys", keys.size(), [&]() {
+        for(int k : keys) found += db.contains(static_cast<int>(items * 4) - 1 - k);
+    });
+
+    for(const std::string& f : files) disksize += std::filesystem::file_size(f);
+    std::printf("  %zu items, %zu bytes on disk (%zu hits)\n", db.size(), disksize, found);
+}
+
+// Blocks actually allocated to 'files', value files are sparse
+size_t disk_usage(const std::vector<std::string>& files) {
+    size_t usage = 0;
+
+    for(const std::string& file : files) {
+        struct stat st;
+        if(::stat(file.c_str(), &st) == 0) usage += static_cast<size_t>(st.st_blocks) * 512;
+    }
+
+    return usage;
+}
+
+// build() then random get() on JSON-like records, with the footprint of the value file
+template<typename DB>
+void bench_records(const char* name, const std::vector<std::pair<int, std::string>>& records, const std::string& basepath) {
+    std::vector<int> keys = random_keys(BATCH_SIZE * 1024, records.size(), 5);
+    size_t found = 0;
+
+    std::printf("%s\n", name);
+    DB db = DB::build("bench_records", records, 0, basepath);
+    for(int k : keys) found += db.get(k).has_value();
+
+    measure("  get() loop", keys.size(), [&]() {
+        for(int k : keys) found += db.get(k).has_value();
+    });
+
+    std::printf("  %zu value bytes/record on disk (%zu hits)\n", disk_usage({basepath + "/bench_records.value"}) / records.size(), found);
+}
+
+// verify() over a table built from 'records', from the page cache
+template<typename DB>
+void bench_verify(const char* name, const std::vector<std::pair<int, std::string>>& records, const std::string& basepath) {
+    DB db = DB::build("bench_verify", records, 0, basepath);
+    size_t corrupted = db.verify().size();
+
+    std::printf("%s\n", name);
+    measure("  verify() 1 thread", records.size(), [&]() { corrupted += db.verify(1).size(); });
+    measure("  verify()", records.size(), [&]() { corrupted += db.verify().size(); });
+    std::printf("  (%zu corrupted)\n", corrupted);
+}
+
+// Load, tombstones, probe lengths and value file usage of a table
+void print_stats(const hashdb_stats& s) {
+    std::printf("  load %.2f, tombstones %.2f, %.3f groups/lookup, value file %zu KB live, %zu KB dead, %zu KB reclaimed\n", s.load_factor(),
+                s.tombstone_ratio(), s.mean_probes(), s.valuelive / 1024, s.valuedead / 1024, s.valuereclaimed / 1024);
+}
+
+// Erases half of the keys, then reports the health of the table and its latencies (hashdb_flags_latency)
+template<typename DB>
+void bench_churn(const char* name, size_t items, const std::string& basepath) {
+    auto value = [](size_t i) { return std::string(24 + (i % 64), static_cast<char>('a' + (i % 26))); };
+    std::vector<int> keys = random_keys(BATCH_SIZE * 1024, items, 6);
+    DB db{"bench_churn", basepath};
+    size_t found = 0;
+
+    std::printf("%s\n", name);
+
+    measure("  set() loop", items, [&]() {
+        for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), value(i));
+    });
+
+    measure("  erase() loop", items / 2, [&]() {
+        for(size_t i = 0; i < items; i += 2) db.erase(static_cast<int>(i));
+    });
+
+    hashdb_stats s = db.stats();
+    std::printf("  set() p99 %lld ns, %zu splits in %lld ms\n", static_cast<long long>(s.set.percentile(0.99).count()), s.splits.count,
+                static_cast<long long>(s.splits.time.count() / 1000000));
+    print_stats(s);
+
+    measure("  collect_garbage()", db.size(), [&]() { db.collect_garbage(); });
+    print_stats(db.stats());
+
+    db.reset_stats();
+
+    measure("  get() loop", keys.size(), [&]() {
+        for(int k : keys) found += db.get(k).has_value();
+    });
+
+    s = db.stats();
+    std::printf("  get() p50 %lld ns, p99 %lld ns (%zu hits)\n", static_cast<long long>(s.get.percentile(0.5).count()),
+                static_cast<long long>(s.get.percentile(0.99).count()), found);
+}
+
+// Erases 7 keys out of 8, then rewrites the others with compact() steps piggy-backed on set(): dead bytes must drop
+template<typename DB>
+void bench_compaction(const char* name, size_t items, const std::string& basepath) {
+    auto value = [](size_t i) { return std::string(100 + (i % 64), static_cast<char>('a' + (i % 26))); };
+    DB db{"bench_compaction", basepath};
+
+    std::printf("%s\n", name);
+    for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), value(i));
+
+    for(size_t i = 0; i < items; ++i) {
+        if(i % 8) db.erase(static_cast<int>(i));
+    }
+
+    hashdb_stats before = db.stats();
+    print_stats(before);
+    db.set_compaction(COMPACTION_BUDGET);
+
+    measure("  set() with compaction", COMPACTION_ROUNDS * (items / 8), [&]() {
+        for(size_t r = 1; r <= COMPACTION_ROUNDS; ++r) {
+            for(size_t i = 0; i < items; i += 8) db.set(static_cast<int>(i), value(i + r));
+        }
+    });
+
+    hashdb_stats after = db.stats();
+    std::printf("  %zu compaction steps, %lld ms\n", after.compactions.count, static_cast<long long>(after.compactions.time.count() / 1000000));
+    print_stats(after);
+    if(after.valuedead >= before.valuedead) std::printf("  (dead bytes did not drop)\n");
+}
+
+// Mean probe length of a linear probing table at 0.75 load indexed by the low bits, like HashDB's directory
+template<typename Hasher, typename Key>
+double probe_length(const std::vector<Key>& keys) {
+    size_t capacity = 1;
+    while(capacity * 3 < keys.size() * 4) capacity <<= 1;
+
+    std::vector<bool> used(capacity);
+    size_t probes = 0;
+
+    for(const Key& k : keys) {
+        size_t i = Hasher::hash(k) & (capacity - 1);
+        for( ; used[i]; i = (i + 1) & (capacity - 1)) ++probes;
+        used[i] = true;
+        ++probes;
+    }
+
+    return static_cast<double>(probes) / static_cast<double>(keys.size());
+}
+
+template<typename Hasher, typename Key>
+void bench_hasher(const char* name, const std::vector<Key>& keys) {
+    size_t sink = 0;
+    measure(name, keys.size() * 16, [&]() {
+        for(size_t i = 0; i < 16; ++i)
+            for(const Key& k : keys) sink += Hasher::hash(k);
+    });
+
+    std::printf("    %-30s %8.2f (%zu)\n", "mean probe length", probe_length<Hasher>(keys), sink & 1);
+}
+
+template<typename Key>
+void bench_hashers(const char* name, const std::vector<Key>& keys) {
+    std::printf("%s\n", name);
+    bench_hasher<impl::FNV1aHasher>("  fnv1a", keys);
+    bench_hasher<impl::Hasher>("  wyhash/mix64", keys);
+}
+
+// Freezes 'db' next to it, then compares lookups and on disk footprint
+template<typename Frozen, typename DB>
+void bench_frozen(const char* name, DB& db, size_t items, const std::string& path, const std::vector<std::string>& files) {
+    std::vector<int> keys = random_keys(BATCH_SIZE * 4096, items, 1);
+    size_t found = 0, opensize = 0;
+
+    std::printf("%s\n", name);
+    measure("  freeze()", db.size(), [&]() { db.freeze(path); });
+
+    Frozen frozen{path};
+    for(int k : keys) found += frozen.get(k).has_value();
+
+    measure("  frozen get() loop", keys.size(), [&]() {
+        for(int k : keys) found += frozen.get(k).has_value();
+    });
+
+    measure("  frozen contains() loop", keys.size(), [&]() {
+        for(int k : keys) found += frozen.contains(k);
+    });
+
+    for(const std::string& f : files) opensize += std::filesystem::file_size(f);
+    std::printf("  %zu bytes/key open, %zu bytes/key frozen (%zu hits)\n", opensize / items, std::filesystem::file_size(path) / items, found);
+    std::filesystem::remove(path);
+}
+
+template<typename DB, typename Value>
+void bench_load(const char* name, size_t items, const std::string& basepath, Value value) {
+    std::vector<std::pair<int, decltype(value(0))>> batch;
+    std::printf("%s\n", name);
+
+    {
+        DB db{"bench_load", basepath};
+
+        measure("  set() loop", items, [&]() {
+            for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), value(i));
+        });
+    }
+
+    {
+        DB db{"bench_load", basepath};
+
+        measure("  set_many()", items, [&]() {
+            for(size_t i = 0; i < items; i += BATCH_SIZE * 64) {
+                batch.clear();
+                for(size_t j = i; j < std::min(items, i + (BATCH_SIZE * 64)); ++j) batch.emplace_back(static_cast<int>(j), value(j));
+                db.set_many(batch);
+            }
+        });
+    }
+
+    {
+        batch.clear();
+        for(size_t i = 0; i < items; ++i) batch.emplace_back(static_cast<int>(i), value(i));
+
+        std::unique_ptr<DB> db;
+        measure("  build()", items, [&]() { db.reset(new DB{DB::build("bench_load", batch, 0, basepath)}); });
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t items = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4 * 1024 * 1024;
+    std::string basepath = argc > 2 ? argv[2] : ".";
+
+    {
+        std::vector<int> sequential(items), strided(items);
+        std::vector<std::string> strings(items);
+
+        for(size_t i = 0; i < items; ++i) {
+            sequential[i] = static_cast<int>(i);
+            strided[i] = static_cast<int>(i << 12);
+            strings[i] = "user:" + std::to_string(i * 7919);
+        }
+
+        bench_hashers("hash sequential int", sequential);
+        bench_hashers("hash int << 12", strided);
+        bench_hashers("hash random int", random_keys(items, items, 2));
+        bench_hashers("hash \"user:N\" strings", strings);
+    }
+
+    auto string_value = [](size_t i) { return std::string(24, static_cast<char>('a' + (i % 26))); };
+    bench_load<HashDB<int, long, hashdb_flags_remove>>("load int -> long", items, basepath, [](size_t i) { return static_cast<long>(i); });
+    bench_load<HashDB<int, std::string, hashdb_flags_remove>>("load int -> std::string", items, basepath, string_value);
+    bench_load<HashDB<int, std::string, hashdb_flags_remove | hashdb_flags_wal>>("load int -> std::string (wal)", items / 4, basepath, string_value);
+
+    {
+        HashDB<int, long, hashdb_flags_remove> db{"bench_int", basepath};
+        for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), static_cast<long>(i));
+        bench_lookups("int -> long", db, items);
+        bench_scan("scan int -> long", db, [](long v) { return static_cast<size_t>(v); });
+        bench_frozen<FrozenHashDB<int, long>>("int -> long (frozen)", db, items, basepath + "/bench_int.frozen", {basepath + "/bench_int.hash"});
+    }
+
+    {
+        HashDB<int, long, hashdb_flags_remove, impl::Serializer, impl::FNV1aHasher> db{"bench_fnv1a", basepath};
+        for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), static_cast<long>(i));
+        bench_lookups("int -> long (fnv1a)", db, items);
+    }
+
+    {
+        HashDB<int, long, hashdb_flags_remove | hashdb_flags_bloom> db{"bench_bloom", basepath};
+        for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), static_cast<long>(i));
+        bench_lookups("int -> long (bloom)", db, items);
+    }
+
+    bench_cache<HashDB<int, long, hashdb_flags_remove | hashdb_flags_cache>>("cache int -> long", items, items / 8, basepath, {basepath + "/bench_cache.hash"});
+
+    {
+        std::vector<std::string> files = {basepath + "/bench_cold.hash", basepath + "/bench_cold.bloom"};
+
+        {
+            HashDB<int, long, hashdb_flags_bloom> db{"bench_cold", basepath};
+            for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), static_cast<long>(i));
+        }
+
+        std::printf("cold misses int -> long\n");
+        bench_cold_misses<HashDB<int, long>>("  contains()", "bench_cold", items, basepath, files);
+        bench_cold_misses<HashDB<int, long, hashdb_flags_bloom>>("  contains() (bloom)", "bench_cold", items, basepath, files);
+        for(const std::string& file : files) std::filesystem::remove(file);
+    }
+
+    {
+        HashDB<int, std::string, hashdb_flags_remove> db{"bench_string", basepath};
+        for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), string_value(i));
+        bench_lookups("int -> std::string", db, items);
+        bench_scan("scan int -> std::string", db, [](const std::string& v) { return v.size(); });
+        bench_hot("hot int -> std::string", db, items, [](const std::string& v) { return v.size(); });
+        print_stats(db.stats());
+        bench_frozen<FrozenHashDB<int, std::string>>("int -> std::string (frozen)", db, items, basepath + "/bench_string.frozen",
+                                                      {basepath + "/bench_string.hash", basepath + "/bench_string.value"});
+    }
+
+    {
+        // Values past InlineSize live in the value file: multi_get() also prefetches their extents
+        HashDB<int, std::string, hashdb_flags_remove> db{"bench_spilled", basepath};
+        for(size_t i = 0; i < items; ++i) db.set(static_cast<int>(i), json_record(i));
+        bench_lookups("int -> json (value file)", db, items);
+    }
+
+    bench_churn<HashDB<int, std::string, hashdb_flags_remove | hashdb_flags_latency>>("churn int -> std::string (latency)", items, basepath);
+    // Draining a region scans every slot: a smaller table keeps the run short
+    bench_compaction<HashDB<int, std::string, hashdb_flags_remove>>("compaction int -> std::string", items / 16, basepath);
+
+    {
+        std::vector<std::pair<int, std::string>> records;
+        for(size_t i = 0; i < items; ++i) records.emplace_back(static_cast<int>(i), json_record(i));
+
+        bench_records<HashDB<int, std::string, hashdb_flags_remove>>("records int -> json", records, basepath);
+        bench_records<HashDB<int, std::string, hashdb_flags_remove | hashdb_flags_compress>>("records int -> json (compress)", records, basepath);
+        bench_records<HashDB<int, std::string, hashdb_flags_remove | hashdb_flags_checksum>>("records int -> json (checksum)", records, basepath);
+        bench_verify<HashDB<int, std::string, hashdb_flags_remove | hashdb_flags_checksum>>("verify int -> json", records, basepath);
+    }
+
+    {
+        HashDB<int, profile, hashdb_flags_remove> db{"bench_profile", basepath};
+
+        for(size_t i = 0; i < items / 8; ++i) {
+            std::string id = std::to_string(i);
+            db.set(static_cast<int>(i), profile{"user number " + id, "user." + id + "@example.com", {"tag:alpha", "tag:beta", "tag:gamma", "region:" + id}});
+        }
+
+        bench_hot("hot int -> profile", db, items / 8, [](const profile& v) { return v.tags.size(); });
+    }
+
+    return 0;
+}
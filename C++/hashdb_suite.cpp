@@ -0,0 +1,360 @@
+// HashDB baseline suite against std::unordered_map and C/map.h, build with:
+//   g++ -std=c++17 -O2 -DNDEBUG hashdb_suite.cpp -lspdlog -lfmt -pthread -o hashdb_suite
+// Usage: hashdb_suite [capacity] [basepath]
+// Every table is sized for 'capacity' slots then filled to each load factor, so they all probe the same memory.
+// HashDB splits a segment as soon as it is 3/4 full, so extendible hashing never reaches a uniform 0.75:
+// the 0.75 rows compare the other tables against a HashDB about half full. Its actual load is printed on its stats line.
+// Integer, floating point and string keys are run with inline (long) and split (VALUE_SIZE bytes string) values.
+// HashDB lookups are also run from a cold page cache: its files are dropped with posix_fadvise(DONTNEED) and reloaded,
+// with the default and the random access profiles, and through get_async() for split values (IO_DEPTH reads in flight),
+// then warmup() pages them back in.
+// One operation out of SAMPLE_STRIDE is timed on its own for the percentiles, they include a clock read.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hashdb.h"
+#include "../C/map.h"
+
+namespace {
+
+constexpr size_t SAMPLE_STRIDE = 16;
+constexpr size_t VALUE_SIZE = 100;
+constexpr size_t COLD_OPS = 64 * 1024;
+constexpr size_t IO_DEPTH = 64;
+constexpr double LOAD_FACTORS[] = {0.25, 0.5, 0.75};
+
+using cstr = const char*; // C/map.h spells 'const V*'
+
+// C/map.h generates its functions for each item type, they are wrapped here for map_table
+template<typename K, typename V>
+struct map_item;
+
+#define SUITE_MAP_ITEM(ITEM, KV, K, V)                                          \
+    ITEM(KV, K, V);                                                             \
+    template<> struct map_item<K, V> {                                          \
+        using type = KV;                                                        \
+        static Map(KV) create(size_t n) { return map_create_n(KV, n); }         \
+        static Map(KV) set(Map(KV) m, K k, V v) { map_set(KV, m, k, v); return m; } \
+        static const V* get(Map(KV) m, K k) { return map_get(KV, m, k); }       \
+        static void erase(Map(KV) m, K k) { _map_del__##KV(m, k); }             \
+    }
+
+SUITE_MAP_ITEM(MapItem, suite_int_long, int64_t, long);
+SUITE_MAP_ITEM(MapItem, suite_int_str, int64_t, cstr);
+SUITE_MAP_ITEM(MapItem, suite_float_long, double, long);
+SUITE_MAP_ITEM(MapItem, suite_float_str, double, cstr);
+SUITE_MAP_ITEM(MapItemStr, suite_str_long, cstr, long);
+SUITE_MAP_ITEM(MapItemStr, suite_str_str, cstr, cstr);
+
+// C/map.h stores strings as pointers into the data set
+template<typename T>
+T to_c(const T& t) { return t; }
+
+cstr to_c(const std::string& s) { return s.c_str(); }
+
+void from_c(long c, long& v) { v = c; }
+void from_c(cstr c, std::string& v) { v.assign(c, VALUE_SIZE); }
+
+template<typename T>
+using c_type = decltype(to_c(std::declval<const T&>()));
+
+template<typename K, typename V>
+struct dataset {
+    std::vector<K> keys, misses;
+    std::vector<V> values;
+};
+
+template<typename K>
+K random_key(std::mt19937_64& rng) {
+    if constexpr(std::is_integral_v<K>) return static_cast<K>(rng());
+    else if constexpr(std::is_floating_point_v<K>) return std::uniform_real_distribution<K>{}(rng);
+    else return "user:" + std::to_string(rng());
+}
+
+template<typename K, typename V>
+dataset<K, V> make_dataset(size_t n) {
+    std::mt19937_64 rng{n};
+    dataset<K, V> d;
+    d.keys.resize(n);
+    d.misses.resize(n);
+    d.values.resize(n);
+
+    for(size_t i = 0; i < n; ++i) {
+        d.keys[i] = random_key<K>(rng);
+        d.misses[i] = random_key<K>(rng);
+
+        if constexpr(std::is_same_v<V, std::string>) {
+            d.values[i].assign(VALUE_SIZE, static_cast<char>('a' + (i % 26)));
+            std::copy_n(reinterpret_cast<const char*>(&i), sizeof(i), d.values[i].data());
+        }
+        else
+            d.values[i] = static_cast<V>(i);
+    }
+
+    return d;
+}
+
+// Drops 'files' from the page cache: the next lookups fault in every page they touch
+void evict(const std::vector<std::string>& files) {
+    for(const std::string& file : files) {
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if(fd == -1) continue;
+        ::fdatasync(fd);
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+}
+
+template<typename K, typename V>
+class hashdb_table {
+    using DB = HashDB<K, V>;
+
+public:
+    hashdb_table(const std::string& basepath, size_t capacity): m_basepath{basepath}, m_db{new DB{"hashdb_suite", basepath}} {
+        while(m_db->capacity() < capacity) m_db->rehash();
+    }
+
+    ~hashdb_table() {
+        m_db.reset();
+        for(const std::string& f : this->files()) std::filesystem::remove(f);
+    }
+
+    static const char* name() { return "HashDB"; }
+    void insert(const K& k, const V& v) { m_db->set(k, v); }
+    bool get(const K& k, V& v) const { return m_db->get(k, v); }
+    void erase(const K& k) { m_db->erase(k); }
+    hashdb_stats stats() const { return m_db->stats(); }
+
+    template<typename Function>
+    void for_each(Function f) const {
+        for(auto it = m_db->begin(); it != m_db->end(); ++it) f(it.value());
+    }
+
+    // Closes the table, drops its files from the page cache and loads it back with 'access'
+    void evict(size_t access = hashdb_access_default) {
+        m_db.reset();
+        ::evict(this->files());
+        m_db.reset(new DB{DB::load("hashdb_suite", m_basepath, access)});
+    }
+
+    size_t warmup() const { return m_db->warmup(); }
+    void set_io_depth(size_t depth) { m_db->set_io_depth(depth); }
+    void wait_async() const { m_db->wait_async(); }
+
+    template<typename Function>
+    void get_async(const K& k, Function f) const { m_db->get_async(k, f); }
+
+private:
+    std::vector<std::string> files() const {
+        std::string path = m_basepath;
+        path.append(impl::PATH_SEPARATOR).append("hashdb_suite");
+        return {path + impl::HASH_SUFFIX, path + impl::VALUE_SUFFIX, path + impl::KEY_SUFFIX};
+    }
+
+    std::string m_basepath;
+    std::unique_ptr<DB> m_db;
+};
+
+template<typename K, typename V>
+class unordered_table {
+public:
+    unordered_table(const std::string&, size_t capacity) { m_map.rehash(capacity); }
+
+    static const char* name() { return "std::unordered_map"; }
+    void insert(const K& k, const V& v) { m_map.insert_or_assign(k, v); }
+    void erase(const K& k) { m_map.erase(k); }
+
+    bool get(const K& k, V& v) const {
+        auto it = m_map.find(k);
+        if(it == m_map.end()) return false;
+        v = it->second;
+        return true;
+    }
+
+    template<typename Function>
+    void for_each(Function f) const {
+        for(const auto& [k, v] : m_map) f(v);
+    }
+
+private:
+    std::unordered_map<K, V> m_map;
+};
+
+template<typename K, typename V>
+class map_table {
+    using item = map_item<c_type<K>, c_type<V>>;
+
+public:
+    map_table(const std::string&, size_t capacity): m_map{item::create(capacity)} { }
+    ~map_table() { map_destroy(m_map); }
+
+    static const char* name() { return "C map.h"; }
+    void insert(const K& k, const V& v) { m_map = item::set(m_map, to_c(k), to_c(v)); }
+    void erase(const K& k) { item::erase(m_map, to_c(k)); }
+
+    bool get(const K& k, V& v) const {
+        const c_type<V>* p = item::get(m_map, to_c(k));
+        if(!p) return false;
+        from_c(*p, v);
+        return true;
+    }
+
+    template<typename Function>
+    void for_each(Function f) const {
+        V v;
+
+        map_foreach(typename item::type, it, m_map) {
+            from_c(it->value, v);
+            f(v);
+        }
+    }
+
+private:
+    typename item::type* m_map;
+};
+
+struct result {
+    double mops{0};
+    std::vector<double> samples; // Nanoseconds
+
+    double percentile(double q) {
+        if(samples.empty()) return 0;
+        size_t i = std::min(static_cast<size_t>(q * static_cast<double>(samples.size())), samples.size() - 1);
+        std::nth_element(samples.begin(), samples.begin() + static_cast<std::ptrdiff_t>(i), samples.end());
+        return samples[i];
+    }
+};
+
+// Calls op(i) for every i in [0, n)
+template<typename Function>
+result run(size_t n, Function op) {
+    using clock = std::chrono::steady_clock;
+    result r;
+    r.samples.reserve((n / SAMPLE_STRIDE) + 1);
+    auto start = clock::now();
+
+    for(size_t i = 0; i < n; ++i) {
+        if(i % SAMPLE_STRIDE) {
+            op(i);
+            continue;
+        }
+
+        auto t = clock::now();
+        op(i);
+        r.samples.push_back(std::chrono::duration<double, std::nano>(clock::now() - t).count());
+    }
+
+    std::chrono::duration<double> elapsed = clock::now() - start;
+    r.mops = static_cast<double>(n) / elapsed.count() / 1e6;
+    return r;
+}
+
+void print(const char* op, const char* name, result r) {
+    std::printf("  %-10s %-24s %8.2f %8.0f %8.0f %8.0f\n", op, name, r.mops, r.percentile(0.5), r.percentile(0.99), r.percentile(0.999));
+}
+
+// Runs every operation on 'Table' with the first order.size() keys of 'd': insert, lookups, iteration then erasure,
+// with cold lookups in between for HashDB. Lookups and erasures visit the keys in 'order'.
+template<typename Table, typename K, typename V>
+void bench_table(const dataset<K, V>& d, const std::vector<size_t>& order, size_t capacity, const std::string& basepath) {
+    const size_t n = order.size();
+    Table t{basepath, capacity};
+    size_t found = 0, visited = 0;
+    V v{};
+
+    print("insert", Table::name(), run(n, [&](size_t i) { t.insert(d.keys[i], d.values[i]); }));
+    print("get hit", Table::name(), run(n, [&](size_t i) { found += t.get(d.keys[order[i]], v); }));
+    print("get miss", Table::name(), run(n, [&](size_t i) { found += t.get(d.misses[i], v); }));
+
+    auto start = std::chrono::steady_clock::now();
+    t.for_each([&](const V&) { ++visited; });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::printf("  %-10s %-24s %8.2f\n", "iterate", Table::name(), static_cast<double>(n) / elapsed.count() / 1e6);
+
+    if constexpr(std::is_same_v<Table, hashdb_table<K, V>>) {
+        hashdb_stats s = t.stats();
+        std::printf("  %-10s %-24s load %.2f, %.3f groups/lookup\n", "stats", Table::name(), s.load_factor(), s.mean_probes());
+
+        const size_t cold = std::min(n, COLD_OPS);
+        t.evict();
+        print("cold hit", Table::name(), run(cold, [&](size_t i) { found += t.get(d.keys[order[i]], v); }));
+        t.evict();
+        print("cold miss", Table::name(), run(cold, [&](size_t i) { found += t.get(d.misses[i], v); }));
+        t.evict(hashdb_access_random);
+        print("cold hit", "HashDB (random)", run(cold, [&](size_t i) { found += t.get(d.keys[order[i]], v); }));
+
+        // Timed samples only cover queueing the read, the rate includes waiting for the last ones
+        if constexpr(std::is_same_v<V, std::string>) {
+            t.evict();
+            t.set_io_depth(IO_DEPTH);
+
+            print("cold hit", "HashDB (get_async)", run(cold, [&](size_t i) {
+                t.get_async(d.keys[order[i]], [&](const K&, std::optional<V> r) { found += r.has_value(); });
+                if(i + 1 == cold) t.wait_async();
+            }));
+        }
+
+        // Back in the page cache before erasing
+        t.evict();
+        start = std::chrono::steady_clock::now();
+        size_t bytes = t.warmup();
+        elapsed = std::chrono::steady_clock::now() - start;
+        std::printf("  %-10s %-24s %8.0f MB/s (%zu MB)\n", "warmup", Table::name(), static_cast<double>(bytes) / elapsed.count() / 1e6, bytes >> 20);
+    }
+
+    print("erase", Table::name(), run(n, [&](size_t i) { t.erase(d.keys[order[i]]); }));
+    if(found < n || visited != n) std::printf("  (%zu hits, %zu visited)\n", found, visited);
+}
+
+template<typename K, typename V>
+void bench_types(const char* name, size_t capacity, const std::string& basepath) {
+    const size_t maxitems = static_cast<size_t>(static_cast<double>(capacity) * LOAD_FACTORS[std::size(LOAD_FACTORS) - 1]);
+    dataset<K, V> d = make_dataset<K, V>(maxitems);
+    std::mt19937_64 rng{capacity};
+
+    for(double lf : LOAD_FACTORS) {
+        size_t n = static_cast<size_t>(static_cast<double>(capacity) * lf);
+        std::vector<size_t> order(n);
+        std::iota(order.begin(), order.end(), size_t{0});
+        std::shuffle(order.begin(), order.end(), rng);
+
+        std::printf("%s, target load %.2f, %zu items\n", name, lf, n);
+        std::printf("  %-35s %8s %8s %8s %8s\n", "", "Mops/s", "p50 ns", "p99 ns", "p99.9 ns");
+
+        bench_table<hashdb_table<K, V>>(d, order, capacity, basepath);
+        bench_table<unordered_table<K, V>>(d, order, capacity, basepath);
+        bench_table<map_table<K, V>>(d, order, capacity, basepath);
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t capacity = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024 * 1024;
+    std::string basepath = argc > 2 ? argv[2] : ".";
+
+    // HashDB capacities are a power of two number of segments
+    capacity = std::max<size_t>(capacity, 4096);
+    while(capacity & (capacity - 1)) capacity &= capacity - 1;
+
+    bench_types<int64_t, long>("int64 -> long", capacity, basepath);
+    bench_types<int64_t, std::string>("int64 -> std::string", capacity, basepath);
+    bench_types<double, long>("double -> long", capacity, basepath);
+    bench_types<double, std::string>("double -> std::string", capacity, basepath);
+    bench_types<std::string, long>("std::string -> long", capacity, basepath);
+    bench_types<std::string, std::string>("std::string -> std::string", capacity, basepath);
+    return 0;
+}